@@ -0,0 +1,414 @@
+#include "ipdb.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Lookup benchmark over a synthetic ipdb file, runs offline:
+//   ./bench [-n networks] [-l languages] [-f fields] [-q queries] [-s seed] [-o file]
+
+struct Options {
+    int networks = 200000;
+    int languages = 2;
+    int fields = 12;
+    int queries = 200000;
+    unsigned seed = 1;
+    std::string file = "/tmp/ipdb-bench.ipdb";
+};
+
+static const char *cityFields[] = {
+        "country_name", "region_name", "city_name", "district_name", "owner_domain", "isp_domain", "latitude",
+        "longitude", "timezone", "utc_offset", "china_admin_code", "idd_code", "country_code", "continent_code",
+        "idc", "base_station", "country_code3", "european_union", "currency_code", "currency_name", "anycast",
+        "line", "district_info", "route", "asn", "asn_info", "area_code", "usage_type"};
+
+struct Address {
+    int family;
+    in_addr v4;
+    in6_addr v6;
+    std::string text;
+};
+
+static Address randomIn(const ipdb::Network &p, std::mt19937_64 &rng) {
+    Address a{};
+    a.family = p.Family;
+    u_char ip[16];
+    auto bytes = p.Family == IPv4 ? 4 : 16;
+    for (auto i = 0; i < bytes; ++i) {
+        auto bit = i * 8;
+        auto length = p.PrefixLength;
+        u_char mask = bit >= length ? 0 : bit + 8 <= length ? 0xFF : u_char(0xFF << (8 - (length - bit)));
+        ip[i] = (p.Address[i] & mask) | (u_char(rng()) & ~mask);
+    }
+    char buf[INET6_ADDRSTRLEN];
+    if (p.Family == IPv4) {
+        memcpy(&a.v4, ip, 4);
+        inet_ntop(AF_INET, ip, buf, sizeof(buf));
+    } else {
+        memcpy(&a.v6, ip, 16);
+        inet_ntop(AF_INET6, ip, buf, sizeof(buf));
+    }
+    a.text = buf;
+    return a;
+}
+
+// dTLB load misses of the calling thread, -1 where perf events are not permitted
+class TLBCounter {
+    int fd = -1;
+public:
+    TLBCounter() {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~TLBCounter() {
+        if (fd >= 0) close(fd);
+    }
+
+    void Start() {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    long long Stop() {
+        long long misses = -1;
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        return read(fd, &misses, sizeof(misses)) == sizeof(misses) ? misses : -1;
+    }
+};
+
+template<typename F>
+static void measure(const std::string &name, const std::vector<Address> &queries, F lookup) {
+    std::vector<uint32_t> latency(queries.size());
+    size_t hits = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < queries.size(); ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        try {
+            if (lookup(queries[i])) {
+                ++hits;
+            }
+        } catch (const char *) {}
+        latency[i] = (uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::sort(latency.begin(), latency.end());
+    auto pct = [&](double p) { return latency[std::min(latency.size() - 1, size_t(p * latency.size()))]; };
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(0) << queries.size() / seconds << " ops/s"
+              << "  p50 " << std::setw(6) << pct(0.5) << "ns  p90 " << std::setw(6) << pct(0.9)
+              << "ns  p99 " << std::setw(6) << pct(0.99) << "ns  p99.9 " << std::setw(7) << pct(0.999)
+              << "ns  hits " << std::setprecision(1) << 100.0 * hits / queries.size() << "%" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    for (auto i = 1; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        if (flag == "-n") opt.networks = std::stoi(argv[i + 1]);
+        else if (flag == "-l") opt.languages = std::stoi(argv[i + 1]);
+        else if (flag == "-f") opt.fields = std::stoi(argv[i + 1]);
+        else if (flag == "-q") opt.queries = std::stoi(argv[i + 1]);
+        else if (flag == "-s") opt.seed = (unsigned) std::stoul(argv[i + 1]);
+        else if (flag == "-o") opt.file = argv[i + 1];
+        else {
+            std::cerr << "usage: " << argv[0] << " [-n networks] [-l languages] [-f fields] [-q queries] [-s seed] [-o file]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    std::mt19937_64 rng(opt.seed);
+    std::vector<std::string> fields;
+    for (auto i = 0; i < opt.fields; ++i) {
+        fields.emplace_back(i < 28 ? cityFields[i] : "field" + std::to_string(i));
+    }
+
+    // networks: 3/4 IPv4 with /8-/32 prefixes, 1/4 IPv6 under 2000::/3 with /16-/64 prefixes,
+    // 10.0.0.0/8 and fc00::/7 stay empty to serve misses
+    std::vector<std::string> languages;
+    for (auto l = 0; l < opt.languages; ++l) {
+        languages.emplace_back("L" + std::to_string(l));
+    }
+    ipdb::Writer writer(fields, languages);
+    std::vector<ipdb::Network> v4, v6;
+    std::uniform_int_distribution<int> len4(8, 32), len6(16, 64);
+    auto pool = std::max(16, opt.networks / 8);
+    for (auto i = 0; i < opt.networks; ++i) {
+        u_char ip[16];
+        for (auto &b : ip) b = u_char(rng());
+        ipdb::Network p;
+        if (i % 4) {
+            if (ip[0] == 10 || ip[0] == 0 || ip[0] >= 224) ip[0] = u_char(1 + ip[0] % 9);
+            p = ipdb::Network(IPv4, ip, std::min(len4(rng), len4(rng) + 8));
+        } else {
+            ip[0] = u_char(0x20 | (ip[0] & 0x1F));
+            p = ipdb::Network(IPv6, ip, len6(rng));
+        }
+        std::vector<std::vector<std::string>> values(opt.languages);
+        for (auto l = 0; l < opt.languages; ++l) {
+            for (auto f = 0; f < opt.fields; ++f) {
+                auto &field = fields[f];
+                values[l].push_back(field == "district_info" || field == "asn_info" ? "" :
+                                    field.substr(0, 4) + "-" + std::to_string(l) + "-" + std::to_string(rng() % pool));
+            }
+        }
+        writer.Insert(p, values);
+        (p.Family == IPv4 ? v4 : v6).push_back(p);
+    }
+    writer.Save(opt.file);
+    std::ifstream in(opt.file, std::ios::binary | std::ios::ate);
+    std::cout << "generated " << opt.file << ": " << v4.size() << " IPv4 + " << v6.size() << " IPv6 networks, "
+              << in.tellg() << " bytes" << std::endl;
+
+    auto makeQueries = [&](const std::vector<ipdb::Network> &nets, int family, bool skewed, double hitRatio) {
+        std::vector<Address> queries;
+        std::vector<double> weights;
+        for (size_t i = 0; i < nets.size(); ++i) {
+            weights.push_back(skewed ? 1.0 / std::pow(double(i + 1), 1.1) : 1.0);
+        }
+        std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+        std::uniform_real_distribution<double> coin(0, 1);
+        u_char reserved[16]{u_char(family == IPv4 ? 10 : 0xFC)};
+        ipdb::Network miss(family, reserved, family == IPv4 ? 8 : 7);
+        for (auto i = 0; i < opt.queries; ++i) {
+            queries.push_back(randomIn(coin(rng) < hitRatio ? nets[pick(rng)] : miss, rng));
+        }
+        return queries;
+    };
+
+    ipdb::City db(opt.file);
+    auto language = std::string("L0");
+    auto prepared = db.Prepare(language, {fields.front(), fields.back()});
+    ipdb::ReaderOptions tableOptions;
+    tableOptions.tableLanguages = {language};
+    ipdb::City tabled(opt.file, tableOptions);
+    auto &table = tabled.Table(language);
+    auto tableStats = tabled.RecordTableStats();
+    std::cout << "record table: " << tableStats.Records << " records, " << tableStats.Strings << " strings, "
+              << tableStats.Bytes << " bytes, built in " << std::setprecision(3) << tableStats.BuildSeconds << "s"
+              << std::endl;
+    ipdb::ReaderOptions trieOptions;
+    trieOptions.engine = ipdb::TrieEngine::Poptrie;
+    auto trieStart = std::chrono::steady_clock::now();
+    ipdb::City poptrie(opt.file, trieOptions);
+    std::cout << "poptrie: " << poptrie.TrieBytes() << " bytes, built in " << std::setprecision(3)
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - trieStart).count() << "s" << std::endl;
+    // two images of the file, standing in for e.g. City and IDC databases queried for every address
+    std::vector<std::shared_ptr<const ipdb::Reader>> pair{std::make_shared<ipdb::City>(opt.file),
+                                                          std::make_shared<ipdb::City>(opt.file)};
+    ipdb::MultiReader multi(pair);
+    for (auto family : {IPv4, IPv6}) {
+        for (auto skewed : {false, true}) {
+            for (auto hitRatio : {0.95, 0.2}) {
+                auto queries = makeQueries(family == IPv4 ? v4 : v6, family, skewed, hitRatio);
+                std::string workload = std::string(family == IPv4 ? "v4" : "v6") + (skewed ? " skewed" : " random") +
+                                       (hitRatio > 0.5 ? " hit-heavy" : " miss-heavy");
+                measure(workload + " Find", queries, [&](const Address &a) {
+                    return !db.Find(a.text, language).empty();
+                });
+                measure(workload + " TryFind", queries, [&](const Address &a) {
+                    std::vector<std::string> result;
+                    return db.TryFind(a.text, language, result) == ipdb::Status::Ok;
+                });
+                measure(workload + " Prepared(2 fields)", queries, [&](const Address &a) {
+                    std::vector<std::string_view> result;
+                    return prepared.TryFind(a.text, result) == ipdb::Status::Ok;
+                });
+                measure(workload + " TryFindRow(2 fields)", queries, [&](const Address &a) {
+                    uint32_t row;
+                    if (tabled.TryFindRow(a.text, language, row) != ipdb::Status::Ok) {
+                        return false;
+                    }
+                    return !table.Get(row, 0).empty() || !table.Get(row, table.Fields().size() - 1).empty();
+                });
+                measure(workload + " TryFindView x2", queries, [&](const Address &a) {
+                    ipdb::RecordView first, second;
+                    auto hit = pair[0]->TryFindView(a.text, language, first) == ipdb::Status::Ok;
+                    return (pair[1]->TryFindView(a.text, language, second) == ipdb::Status::Ok) && hit;
+                });
+                measure(workload + " MultiReader(2)", queries, [&](const Address &a) {
+                    ipdb::MultiResult result;
+                    return multi.TryFind(a.text, language, result) == ipdb::Status::Ok &&
+                           result.Statuses[0] == ipdb::Status::Ok && result.Statuses[1] == ipdb::Status::Ok;
+                });
+                measure(workload + " FindMap", queries, [&](const Address &a) {
+                    return !db.FindMap(a.text, language).empty();
+                });
+                measure(workload + " FindInfo", queries, [&](const Address &a) {
+                    db.FindInfo(a.text, language);
+                    return true;
+                });
+                measure(workload + " ParseAddress+FindBatch", queries, [&](const Address &a) {
+                    ipdb::Address addr;
+                    ipdb::RecordView view;
+                    ipdb::ParseAddress(a.text, addr);
+                    db.FindBatch(&addr, 1, language, &view);
+                    return !view.Empty();
+                });
+                measure(workload + " FindView(binary)", queries, [&](const Address &a) {
+                    return !(a.family == IPv4 ? db.FindView(a.v4, language) : db.FindView(a.v6, language)).Empty();
+                });
+                measure(workload + " TryFindView(binary)", queries, [&](const Address &a) {
+                    ipdb::RecordView view;
+                    return (a.family == IPv4 ? db.TryFindView(a.v4, language, view)
+                                             : db.TryFindView(a.v6, language, view)) == ipdb::Status::Ok;
+                });
+                measure(workload + " TryFindView(poptrie)", queries, [&](const Address &a) {
+                    ipdb::RecordView view;
+                    return (a.family == IPv4 ? poptrie.TryFindView(a.v4, language, view)
+                                             : poptrie.TryFindView(a.v6, language, view)) == ipdb::Status::Ok;
+                });
+            }
+        }
+    }
+    // ParallelFind over the hit-heavy IPv4 queries, 1 thread and one per core
+    {
+        auto queries = makeQueries(v4, IPv4, false, 0.95);
+        std::vector<in_addr> addrs;
+        for (auto &q : queries) {
+            addrs.push_back(q.v4);
+        }
+        std::vector<ipdb::RecordView> out(addrs.size());
+        for (auto threads : {1u, std::max(1u, std::thread::hardware_concurrency())}) {
+            auto t0 = std::chrono::steady_clock::now();
+            db.ParallelFind(addrs.data(), addrs.size(), language, out.data(), int(threads));
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            std::cout << "v4 ParallelFind " << threads << " threads " << std::setprecision(0)
+                      << addrs.size() / seconds << " ops/s" << std::endl;
+        }
+    }
+
+    // field index: lazy parallel build over all leaves, then set queries
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        auto index = db.Index(language, fields.front());
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        auto values = index->Values();
+        size_t networks = 0;
+        t0 = std::chrono::steady_clock::now();
+        for (auto &value : values) {
+            networks += index->Get(value).Networks().size();
+        }
+        auto networkSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << "index " << fields.front() << ": " << values.size() << " values, " << index->Bytes()
+                  << " bytes, built in " << std::setprecision(3) << seconds << "s; " << networks
+                  << " networks listed in " << networkSeconds << "s" << std::endl;
+    }
+
+    // image backing options: load time, huge page coverage, lookup latency and dTLB misses of random lookups
+    {
+        auto v4queries = makeQueries(v4, IPv4, false, 0.95), v6queries = makeQueries(v6, IPv6, false, 0.95);
+        struct Backing {
+            const char *name;
+            ipdb::ReaderOptions options;
+        };
+        std::vector<Backing> backings(7);
+        backings[0].name = "heap";
+        backings[1].name = "heap, transparent huge pages";
+        backings[1].options.hugePages = ipdb::HugePages::Transparent;
+        backings[2].name = "heap, explicit huge pages";
+        backings[2].options.hugePages = ipdb::HugePages::Explicit;
+        backings[3].name = "heap, mlock";
+        backings[3].options.mlock = true;
+        backings[4].name = "mmap";
+        backings[4].options.mmap = true;
+        backings[5].name = "mmap, prefault, random access";
+        backings[5].options.mmap = true;
+        backings[5].options.prefault = true;
+        backings[5].options.randomAccess = true;
+        backings[6].name = "mmap, transparent huge pages";
+        backings[6].options.mmap = true;
+        backings[6].options.hugePages = ipdb::HugePages::Transparent;
+        TLBCounter tlb;
+        for (auto &backing : backings) {
+            try {
+                auto t0 = std::chrono::steady_clock::now();
+                ipdb::City image(opt.file, backing.options);
+                auto loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                auto stats = image.ImageStats();
+                std::cout << std::left << std::setw(32) << backing.name << std::right << " load " << std::setprecision(3)
+                          << loadSeconds << "s, huge pages " << std::setprecision(0)
+                          << 100.0 * stats.HugePageBytes / stats.Bytes << "%";
+                for (auto queries : {&v4queries, &v6queries}) {
+                    size_t hits = 0;
+                    tlb.Start();
+                    auto t1 = std::chrono::steady_clock::now();
+                    ipdb::RecordView view;
+                    for (auto &a : *queries) {
+                        hits += (a.family == IPv4 ? image.TryFindView(a.v4, language, view)
+                                                  : image.TryFindView(a.v6, language, view)) == ipdb::Status::Ok;
+                    }
+                    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t1).count();
+                    auto misses = tlb.Stop();
+                    std::cout << (queries == &v4queries ? ", v4 " : ", v6 ") << std::setprecision(1)
+                              << ns / queries->size() << "ns";
+                    if (misses >= 0) {
+                        std::cout << " " << std::setprecision(2) << double(misses) / queries->size() << " dTLB misses";
+                    }
+                    std::cout << (hits ? "" : " (no hits)");
+                }
+                std::cout << std::endl;
+            } catch (const char *e) {
+                std::cout << std::left << std::setw(32) << backing.name << std::right << " " << e << std::endl;
+            }
+        }
+    }
+
+    // bulk parsing of newline-separated text, as read from a log
+    for (auto family : {IPv4, IPv6}) {
+        auto queries = makeQueries(family == IPv4 ? v4 : v6, family, false, 1.0);
+        std::string buffer;
+        for (auto &q : queries) {
+            buffer += q.text + "\n";
+        }
+        std::vector<ipdb::Address> parsed;
+        ipdb::ParseAddresses(buffer, '\n', parsed); // the output pages are faulted in once, outside the timing
+        parsed.clear();
+        auto t0 = std::chrono::steady_clock::now();
+        ipdb::ParseAddresses(buffer, '\n', parsed);
+        auto t1 = std::chrono::steady_clock::now();
+        for (auto &q : queries) {
+            u_char ip[16]; // the family is not known up front
+            if (inet_pton(AF_INET, q.text.c_str(), ip) != 1) {
+                inet_pton(AF_INET6, q.text.c_str(), ip);
+            }
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        auto ns = [&](std::chrono::steady_clock::duration d) {
+            return std::chrono::duration<double, std::nano>(d).count() / queries.size();
+        };
+        std::cout << (family == IPv4 ? "v4" : "v6") << " ParseAddresses " << std::setprecision(1) << ns(t1 - t0)
+                  << " ns/address, inet_pton per line " << ns(t2 - t1) << " ns/address" << std::endl;
+    }
+    auto metrics = db.Metrics(); // built with -DIPDB_METRICS
+    if (metrics.Enabled) {
+        auto calls = std::accumulate(std::begin(metrics.Latency), std::end(metrics.Latency), uint64_t(0));
+        std::cout << "metrics: " << metrics.Lookups[0] << " IPv4 + " << metrics.Lookups[1] << " IPv6 lookups, "
+                  << metrics.Results[int(ipdb::Status::Ok)] << " hits, " << metrics.ResolveBytes
+                  << " bytes resolved, mean " << std::setprecision(1)
+                  << double(metrics.LatencyNanoseconds) / std::max<uint64_t>(1, calls) << "ns" << std::endl;
+    }
+    return 0;
+}
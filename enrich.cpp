@@ -0,0 +1,458 @@
+#include "ipdb.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// Streaming log enrichment: reads newline-delimited records from files or stdin, looks up one IP column
+// and writes each record with the selected fields appended.
+//   ./ipdb-enrich -d file [-t city|idc|basestation] [-l language] [-f field,...] [-c column] [-s separator]
+//                 [-o tsv|csv|json] [-H] [-j threads] [-b block KB] [-v] [input...]
+// Blocks of whole lines flow from a reader thread through lookup workers to a writer that keeps input order.
+
+struct Options {
+    std::string database;
+    std::string type = "city";
+    std::string language = "CN";
+    std::vector<std::string> fields; // empty: every field of the database
+    int column = 1;                  // 1-based IP column, 0: the whole line
+    char separator = 0;              // default: ',' for csv, tab otherwise
+    std::string format = "tsv";
+    bool header = false;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t blockSize = 1 << 20;
+    bool verbose = false;
+    std::vector<std::string> inputs;
+};
+
+struct Block {
+    size_t seq = 0;
+    std::string in;
+    std::string out;
+    size_t lines = 0;
+    size_t hits = 0;
+};
+
+// A bounded FIFO of blocks, Pop returns false once closed and drained.
+class BlockQueue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Block> blocks;
+    size_t capacity;
+    bool closed = false;
+public:
+    explicit BlockQueue(size_t capacity) : capacity(capacity) {}
+
+    void Push(Block &&block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return blocks.size() < capacity; });
+        blocks.push_back(std::move(block));
+        changed.notify_all();
+    }
+
+    bool Pop(Block &block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return !blocks.empty() || closed; });
+        if (blocks.empty()) {
+            return false;
+        }
+        block = std::move(blocks.front());
+        blocks.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        changed.notify_all();
+    }
+};
+
+// Finished blocks, handed to the writer in sequence order. Put waits while a block is capacity or more ahead
+// of the one the writer needs, so a stalled block cannot make the others pile up.
+class Reorder {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<size_t, Block> done;
+    size_t capacity;
+    size_t next = 0;
+    size_t total = SIZE_MAX;
+public:
+    explicit Reorder(size_t capacity) : capacity(capacity) {}
+
+    void Put(Block &&block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // the block the writer needs was popped before any later one, so it is never stuck behind this wait
+        changed.wait(lock, [&] { return block.seq < next + capacity; });
+        done.emplace(block.seq, std::move(block));
+        changed.notify_all();
+    }
+
+    // total is known once the reader is done
+    void Finish(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        total = count;
+        changed.notify_all();
+    }
+
+    bool Next(Block &block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return next == total || (!done.empty() && done.begin()->first == next); });
+        if (next == total) {
+            return false;
+        }
+        block = std::move(done.begin()->second);
+        done.erase(done.begin());
+        ++next;
+        changed.notify_all();
+        return true;
+    }
+};
+
+static void appendJSON(std::string &out, std::string_view value) {
+    out += '"';
+    for (auto c : value) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (u_char(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+}
+
+static void appendCSV(std::string &out, std::string_view value) {
+    if (value.find_first_of(",\"\r\n") == std::string_view::npos) {
+        out += value;
+        return;
+    }
+    out += '"';
+    for (auto c : value) {
+        if (c == '"') {
+            out += '"';
+        }
+        out += c;
+    }
+    out += '"';
+}
+
+static std::string_view column(std::string_view line, char separator, int index) {
+    if (index == 0) {
+        return line;
+    }
+    for (auto i = 1; i < index; ++i) {
+        auto pos = line.find(separator);
+        if (pos == std::string_view::npos) {
+            return {};
+        }
+        line.remove_prefix(pos + 1);
+    }
+    return line.substr(0, line.find(separator));
+}
+
+class Enricher {
+    const Options &opt;
+    ipdb::PreparedQuery query;
+public:
+    Enricher(const Options &opt, const ipdb::Reader &db) : opt(opt), query(db.Prepare(opt.language, opt.fields)) {}
+
+    const std::vector<std::string> &Fields() const {
+        return query.Fields();
+    }
+
+    std::string Header() const {
+        std::string out;
+        if (opt.format == "json") {
+            return out;
+        }
+        out += opt.format == "csv" ? "line" : "#line";
+        for (auto &field : Fields()) {
+            out += opt.format == "csv" ? ',' : '\t';
+            out += field;
+        }
+        out += '\n';
+        return out;
+    }
+
+    void Process(Block &block) const {
+        std::vector<std::string_view> values;
+        std::string_view in(block.in);
+        block.out.reserve(block.in.size() * 2);
+        while (!in.empty()) {
+            auto end = in.find('\n');
+            auto line = in.substr(0, end);
+            in.remove_prefix(end == std::string_view::npos ? in.size() : end + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            ++block.lines;
+            auto hit = lookup(column(line, opt.separator, opt.column), values);
+            block.hits += hit;
+            auto &out = block.out;
+            if (opt.format == "json") {
+                out += "{\"line\":";
+                appendJSON(out, line);
+                for (size_t i = 0; i < Fields().size(); ++i) {
+                    out += ',';
+                    appendJSON(out, Fields()[i]);
+                    out += ':';
+                    appendJSON(out, hit ? values[i] : std::string_view());
+                }
+                out += "}\n";
+            } else if (opt.format == "csv") {
+                out += line; // already CSV
+                for (size_t i = 0; i < Fields().size(); ++i) {
+                    out += ',';
+                    appendCSV(out, hit ? values[i] : std::string_view());
+                }
+                out += '\n';
+            } else {
+                out += line;
+                for (size_t i = 0; i < Fields().size(); ++i) {
+                    out += '\t';
+                    if (hit) {
+                        out += values[i];
+                    }
+                }
+                out += '\n';
+            }
+        }
+    }
+
+private:
+    bool lookup(std::string_view text, std::vector<std::string_view> &values) const {
+        // tolerate surrounding quotes and spaces, e.g. from CSV
+        while (!text.empty() && (text.front() == '"' || text.front() == ' ')) text.remove_prefix(1);
+        while (!text.empty() && (text.back() == '"' || text.back() == ' ')) text.remove_suffix(1);
+        ipdb::Address addr;
+        switch (ipdb::ParseAddress(text, addr)) {
+            case IPv4: {
+                in_addr v4;
+                memcpy(&v4, addr.Bytes, 4);
+                return query.TryFind(v4, values) == ipdb::Status::Ok;
+            }
+            case IPv6: {
+                in6_addr v6;
+                memcpy(&v6, addr.Bytes, 16);
+                return query.TryFind(v6, values) == ipdb::Status::Ok;
+            }
+            default:
+                return false;
+        }
+    }
+};
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> out;
+    size_t start = 0;
+    while (start <= list.size()) {
+        auto end = std::min(list.find(',', start), list.size());
+        if (end > start) {
+            out.push_back(list.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+static int usage(const char *name) {
+    std::cerr << "usage: " << name << " -d file [-t city|idc|basestation] [-l language] [-f field,...] [-c column]"
+              << " [-s separator] [-o tsv|csv|json] [-H] [-j threads] [-b block KB] [-v] [input...]" << std::endl;
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    for (auto i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw "missing option value.";
+            }
+            return argv[++i];
+        };
+        try {
+            if (flag == "-d") opt.database = value();
+            else if (flag == "-t") opt.type = value();
+            else if (flag == "-l") opt.language = value();
+            else if (flag == "-f") opt.fields = split(value());
+            else if (flag == "-c") opt.column = std::stoi(value());
+            else if (flag == "-s") {
+                auto s = value();
+                opt.separator = s == "\\t" || s.empty() ? '\t' : s[0];
+            } else if (flag == "-o") opt.format = value();
+            else if (flag == "-H") opt.header = true;
+            else if (flag == "-j") opt.threads = std::max(1, std::stoi(value()));
+            else if (flag == "-b") opt.blockSize = std::max(4, std::stoi(value())) * size_t(1024);
+            else if (flag == "-v") opt.verbose = true;
+            else if (flag == "-" || flag[0] != '-') opt.inputs.push_back(flag);
+            else return usage(argv[0]);
+        } catch (...) {
+            return usage(argv[0]);
+        }
+    }
+    if (opt.database.empty() || opt.column < 0 ||
+        (opt.format != "tsv" && opt.format != "csv" && opt.format != "json")) {
+        return usage(argv[0]);
+    }
+    if (opt.separator == 0) {
+        opt.separator = opt.format == "csv" ? ',' : '\t';
+    }
+    if (opt.inputs.empty()) {
+        opt.inputs.emplace_back("-");
+    }
+
+    std::shared_ptr<ipdb::Reader> db;
+    std::unique_ptr<Enricher> enricher;
+    try {
+        if (opt.type == "city") db = std::make_shared<ipdb::City>(opt.database);
+        else if (opt.type == "idc") db = std::make_shared<ipdb::IDC>(opt.database);
+        else if (opt.type == "basestation") db = std::make_shared<ipdb::BaseStation>(opt.database);
+        else return usage(argv[0]);
+        enricher.reset(new Enricher(opt, *db));
+    } catch (const char *e) {
+        std::cerr << opt.database << ": " << e << std::endl;
+        return 1;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    BlockQueue pending(size_t(opt.threads) * 2);
+    Reorder finished(size_t(opt.threads) * 4);
+    std::string failed;
+    size_t bytesIn = 0;
+
+    std::thread reader([&] {
+        size_t seq = 0;
+        std::string carry; // the unterminated tail of the previous read
+        auto endLine = [&] { // a file without a final newline still ends its last line
+            if (!carry.empty()) {
+                Block block;
+                block.seq = seq++;
+                block.in.swap(carry);
+                pending.Push(std::move(block));
+            }
+        };
+        for (auto &input : opt.inputs) {
+            auto file = input == "-" ? stdin : fopen(input.c_str(), "rb");
+            if (file == nullptr) {
+                failed = input + ": " + strerror(errno);
+                endLine();
+                break;
+            }
+            setvbuf(file, nullptr, _IONBF, 0); // reads are already block sized
+            for (;;) {
+                Block block;
+                block.seq = seq;
+                block.in.swap(carry);
+                auto size = block.in.size();
+                block.in.resize(size + opt.blockSize);
+                auto n = fread(&block.in[size], 1, opt.blockSize, file);
+                block.in.resize(size + n);
+                bytesIn += n;
+                if (n == 0) {
+                    carry.swap(block.in);
+                    break;
+                }
+                auto last = block.in.rfind('\n');
+                if (last == std::string::npos) {
+                    carry.swap(block.in); // no complete line yet
+                    continue;
+                }
+                carry.assign(block.in, last + 1, std::string::npos);
+                block.in.resize(last + 1);
+                pending.Push(std::move(block));
+                ++seq;
+            }
+            if (ferror(file)) {
+                failed = input + ": " + strerror(errno);
+            }
+            if (file != stdin) {
+                fclose(file);
+            }
+            endLine();
+            if (!failed.empty()) {
+                break;
+            }
+        }
+        pending.Close();
+        finished.Finish(seq);
+    });
+
+    std::vector<std::thread> workers;
+    for (auto i = 0; i < opt.threads; ++i) {
+        workers.emplace_back([&] {
+            Block block;
+            while (pending.Pop(block)) {
+                enricher->Process(block);
+                block.in = std::string();
+                finished.Put(std::move(block));
+            }
+        });
+    }
+
+    std::vector<char> buffer(4 << 20);
+    setvbuf(stdout, buffer.data(), _IOFBF, buffer.size());
+    if (opt.header) {
+        auto header = enricher->Header();
+        fwrite(header.data(), 1, header.size(), stdout);
+    }
+    size_t lines = 0, hits = 0, bytesOut = 0;
+    bool writeFailed = false;
+    Block block;
+    while (finished.Next(block)) {
+        lines += block.lines;
+        hits += block.hits;
+        bytesOut += block.out.size();
+        if (!writeFailed && fwrite(block.out.data(), 1, block.out.size(), stdout) != block.out.size()) {
+            writeFailed = true; // keep draining so the pipeline can finish
+        }
+    }
+    reader.join();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    if (fflush(stdout) != 0) {
+        writeFailed = true;
+    }
+
+    if (opt.verbose) {
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        fprintf(stderr, "%zu lines, %zu hits, %zu bytes in, %zu bytes out, %.2fs, %.1f MB/s\n",
+                lines, hits, bytesIn, bytesOut, seconds, bytesIn / seconds / 1e6);
+    }
+    if (!failed.empty()) {
+        std::cerr << failed << std::endl;
+        return 1;
+    }
+    if (writeFailed) {
+        std::cerr << "write error: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -6,8 +6,27 @@
 #include <rapidjson/writer.h>
 #include <rapidjson/stringbuffer.h>
 #include <fstream>
+#include <functional>
 #include <sstream>
+#include <algorithm>
+#include <array>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 using namespace rapidjson;
@@ -29,501 +48,3675 @@ void ipdb::MetaData::Parse(const string &json) {
     }
 }
 
+const char *ipdb::StatusString(Status status) {
+    switch (status) {
+        case Status::Ok:
+            return "ok.";
+        case Status::IPFormat:
+            return ErrIPFormat;
+        case Status::NoSupportLanguage:
+            return ErrNoSupportLanguage;
+        case Status::NoSupportIPv4:
+            return ErrNoSupportIPv4;
+        case Status::NoSupportIPv6:
+            return ErrNoSupportIPv6;
+        case Status::DataNotExists:
+            return ErrDataNotExists;
+        case Status::DatabaseError:
+            break;
+    }
+    return ErrDatabaseError;
+}
+
+static void check(ipdb::Status status) {
+    if (status != ipdb::Status::Ok) {
+        throw ipdb::StatusString(status);
+    }
+}
+
+ipdb::RecordView::RecordView(string_view record, int offset, const vector<string> &fields, const Network &network) {
+    if (!assign(record, offset, fields, network)) {
+        throw ErrDatabaseError;
+    }
+}
+
+bool ipdb::RecordView::assign(string_view record, int offset, const vector<string> &fields, const Network &network) {
+    string_view::size_type begin = 0;
+    for (auto i = 0; i < offset; ++i) {
+        begin = record.find('\t', begin);
+        if (begin == string_view::npos) {
+            return false;
+        }
+        ++begin;
+    }
+    auto end = begin;
+    for (size_t i = 1; i < fields.size(); ++i) {
+        end = record.find('\t', end);
+        if (end == string_view::npos) {
+            return false;
+        }
+        ++end;
+    }
+    end = record.find('\t', end);
+    this->body = record.substr(begin, end == string_view::npos ? string_view::npos : end - begin);
+    this->fields = &fields;
+    this->network = network;
+    return true;
+}
+
+size_t ipdb::RecordView::Size() const {
+    return fields ? fields->size() : 0;
+}
+
+bool ipdb::RecordView::Empty() const {
+    return Size() == 0;
+}
+
+const ipdb::Network &ipdb::RecordView::GetNetwork() const {
+    return network;
+}
+
+string_view ipdb::RecordView::Record() const {
+    return body;
+}
+
+string_view ipdb::RecordView::Get(size_t index) const {
+    if (index >= Size()) {
+        return {};
+    }
+    string_view::size_type begin = 0;
+    for (size_t i = 0; i < index; ++i) {
+        begin = body.find('\t', begin) + 1;
+    }
+    auto end = body.find('\t', begin);
+    return body.substr(begin, end == string_view::npos ? string_view::npos : end - begin);
+}
+
+string_view ipdb::RecordView::Get(string_view name) const {
+    for (size_t i = 0; i < Size(); ++i) {
+        if ((*fields)[i] == name) {
+            return Get(i);
+        }
+    }
+    return {};
+}
+
+string_view ipdb::RecordView::operator[](size_t index) const {
+    return Get(index);
+}
+
+string_view ipdb::RecordView::operator[](string_view name) const {
+    return Get(name);
+}
+
+const vector<string> &ipdb::RecordView::Fields() const {
+    static const vector<string> empty;
+    return fields ? *fields : empty;
+}
+
+vector<string> ipdb::RecordView::ToVector() const {
+    vector<string> result;
+    result.reserve(Size());
+    string_view::size_type begin = 0;
+    for (size_t i = 0; i < Size(); ++i) {
+        auto end = body.find('\t', begin);
+        result.emplace_back(body.substr(begin, end == string_view::npos ? string_view::npos : end - begin));
+        begin = end + 1;
+    }
+    return result;
+}
+
+map<string, string> ipdb::RecordView::ToMap() const {
+    map<string, string> info;
+    string_view::size_type begin = 0;
+    for (size_t i = 0; i < Size(); ++i) {
+        auto end = body.find('\t', begin);
+        info[(*fields)[i]] = string(body.substr(begin, end == string_view::npos ? string_view::npos : end - begin));
+        begin = end + 1;
+    }
+    return info;
+}
+
 int ipdb::Reader::readNode(int node, int index) const {
     auto off = node * 8 + index * 4;
-    return ntohl(static_cast<uint32_t>(*(int *) &data.get()[off]));
+    uint32_t value;
+    memcpy(&value, &data[off], 4); // the node array follows the metadata, so it is not 4-byte aligned
+    return ntohl(value);
 }
 
-string ipdb::Reader::resolve(int node) {
+ipdb::Status ipdb::Reader::resolve(int node, string_view &body) const {
     auto resolved = node - meta.NodeCount + meta.NodeCount * 8;
-    if (resolved >= fileSize) {
-        throw ErrDatabaseError;
+    if (resolved + 2 > dataSize) {
+        return Status::DatabaseError;
     }
-    std::size_t size = (data.get()[resolved] << 8) | data.get()[resolved + 1];
+    std::size_t size = (data[resolved] << 8) | data[resolved + 1];
     if ((resolved + 2 + size) > dataSize) {
-        throw ErrDatabaseError;
+        return Status::DatabaseError;
     }
-    string bytes{(const char *) data.get() + resolved + 2, size};
-    return bytes;
+    body = {(const char *) data + resolved + 2, size};
+    return Status::Ok;
 }
 
-int ipdb::Reader::search(const u_char *ip, int bitCount) const {
-    int node = 0;
-    if (bitCount == 32) {
-        node = v4offset;
-    } else {
-        node = 0;
+int ipdb::Reader::start(const u_char *ip, int bitCount, int &depth) const {
+    if (bitCount != 32) {
+        depth = 0;
+        return 0;
+    }
+    if (v4table.empty()) {
+        depth = 0;
+        return v4offset;
+    }
+    auto prefix = (uint32_t(ip[0]) << 24) | (uint32_t(ip[1]) << 16) | (uint32_t(ip[2]) << 8) | uint32_t(ip[3]);
+    auto node = v4table[prefix >> uint(32 - v4TableBits)];
+    depth = node > meta.NodeCount ? v4depth[prefix >> uint(32 - v4TableBits)] : v4TableBits;
+    return node;
+}
+
+// A poptrie over the binary trie of one family. The first topBits bits index a table; below it each node covers
+// stride bits with a bitmap of the slots that descend and a bitmap of where runs of equal leaves start, and the
+// popcount below a slot locates its child or leaf. Leaves keep the binary node and depth the bit walk ends with.
+class ipdb::Poptrie {
+public:
+    static constexpr int topBits = 16;
+    static constexpr int stride = 6;
+    static constexpr uint64_t internalFlag = uint64_t(1) << 63;
+
+    struct Node {
+        uint64_t internal;
+        uint64_t leafRuns;
+        uint32_t children;
+        uint32_t leaves;
+    };
+
+    int bitCount = 0;
+    vector<uint64_t> top;      // a leaf, or internalFlag | node index
+    vector<Node> nodes;
+    vector<uint32_t> children; // node indices, those of one node consecutive; shared subtrees are built once
+    vector<uint64_t> leaves;   // binary node << 8 | depth
+
+    static uint64_t Leaf(int node, int depth) {
+        return uint64_t(uint32_t(node)) << 8 | uint32_t(depth);
+    }
+
+    int Search(const u_char *ip, int &depth) const {
+        auto entry = top[uint32_t(ip[0]) << 8 | ip[1]];
+        auto d = topBits;
+        while (entry & internalFlag) {
+            auto &node = nodes[uint32_t(entry)];
+            auto k = min(stride, bitCount - d);
+            auto byte = d >> 3;
+            auto window = uint32_t(ip[byte]) << 8 | (byte + 1 < bitCount / 8 ? ip[byte + 1] : 0);
+            auto slot = (window >> uint(16 - (d & 7) - k)) & ((1u << uint(k)) - 1);
+            auto upTo = (uint64_t(2) << slot) - 1; // slots 0..slot
+            if (node.internal >> slot & 1) {
+                entry = internalFlag | children[node.children + __builtin_popcountll(node.internal & upTo) - 1];
+                d += k;
+            } else {
+                entry = leaves[node.leaves + __builtin_popcountll(node.leafRuns & upTo) - 1];
+            }
+        }
+        depth = int(entry & 0xFF);
+        return int(uint32_t(entry >> 8));
+    }
+
+    size_t Bytes() const {
+        return top.size() * sizeof(uint64_t) + nodes.size() * sizeof(Node) + children.size() * sizeof(uint32_t) +
+               leaves.size() * sizeof(uint64_t);
     }
-    for (auto i = 0; i < bitCount; ++i) {
+};
+
+shared_ptr<const ipdb::Poptrie> ipdb::Reader::buildTrie(int root, int bitCount) const {
+    auto trie = make_shared<Poptrie>();
+    trie->bitCount = bitCount;
+    struct Step {
+        int node;
+        int depth;
+        bool leaf;
+    };
+    // the bit walk search() makes over the k bits of value, from node at depth
+    auto walk = [&](int node, int depth, uint32_t value, int k) {
+        for (auto j = 0; j < k; ++j) {
+            if (node > meta.NodeCount) {
+                return Step{node, depth, true};
+            }
+            node = readNode(node, (value >> uint(k - 1 - j)) & 1);
+            ++depth;
+        }
+        return Step{node, depth, node > meta.NodeCount || depth == bitCount};
+    };
+    unordered_map<uint64_t, uint32_t> built; // binary node and depth to trie node
+    function<uint32_t(int, int)> expand = [&](int node, int depth) {
+        auto key = Poptrie::Leaf(node, depth);
+        auto it = built.find(key);
+        if (it != built.end()) {
+            return it->second;
+        }
+        auto k = min(Poptrie::stride, bitCount - depth);
+        Poptrie::Node n{};
+        vector<uint32_t> children;
+        vector<uint64_t> leaves;
+        for (uint32_t slot = 0; slot < (1u << uint(k)); ++slot) {
+            auto step = walk(node, depth, slot, k);
+            if (!step.leaf) {
+                n.internal |= uint64_t(1) << slot;
+                children.push_back(expand(step.node, step.depth));
+                continue;
+            }
+            auto leaf = Poptrie::Leaf(step.node, step.depth);
+            if (leaves.empty() || leaves.back() != leaf) {
+                n.leafRuns |= uint64_t(1) << slot;
+                leaves.push_back(leaf);
+            }
+        }
+        n.children = uint32_t(trie->children.size());
+        trie->children.insert(trie->children.end(), children.begin(), children.end());
+        n.leaves = uint32_t(trie->leaves.size());
+        trie->leaves.insert(trie->leaves.end(), leaves.begin(), leaves.end());
+        auto index = uint32_t(trie->nodes.size());
+        trie->nodes.push_back(n);
+        built.emplace(key, index);
+        return index;
+    };
+    trie->top.resize(size_t(1) << uint(Poptrie::topBits));
+    for (uint32_t value = 0; value < trie->top.size(); ++value) {
+        auto step = walk(root, 0, value, Poptrie::topBits);
+        trie->top[value] = step.leaf ? Poptrie::Leaf(step.node, step.depth)
+                                     : Poptrie::internalFlag | expand(step.node, step.depth);
+    }
+    return trie;
+}
+
+int ipdb::Reader::search(const u_char *ip, int bitCount, int &depth) const {
+    auto &trie = bitCount == 32 ? v4trie : v6trie;
+    if (trie) {
+        return trie->Search(ip, depth);
+    }
+    int i = 0;
+    int node = start(ip, bitCount, i);
+    for (; i < bitCount; ++i) {
         if (node > meta.NodeCount) {
             break;
         }
         node = readNode(node, ((0xFF & int(ip[i >> 3])) >> uint(7 - (i % 8))) & 1);
     }
-    if (node > meta.NodeCount) {
-        return node;
+    depth = i;
+    return node;
+}
+
+static bool prefixMatch(const u_char *network, const u_char *ip, int prefixLength) {
+    auto bytes = prefixLength / 8;
+    if (memcmp(network, ip, bytes) != 0) {
+        return false;
+    }
+    if (prefixLength % 8 == 0) {
+        return true;
     }
-    throw ErrDataNotExists;
+    auto mask = u_char(0xFF << uint(8 - prefixLength % 8));
+    return (network[bytes] & mask) == (ip[bytes] & mask);
 }
 
-string ipdb::Reader::find0(const string &addr) {
-    int node = 0;
-    struct in_addr addr4{};
-    struct in6_addr addr6{};
-    if (inet_pton(AF_INET, addr.c_str(), &addr4)) {
-        if (!IsIPv4Support()) {
-            throw ErrNoSupportIPv4;
+class ipdb::RangeCache {
+public:
+    struct Entry {
+        Network network;
+        string_view record;
+        Reader::InfoSlot info;
+    };
+
+private:
+    typedef array<u_char, 17> Key; // family, then the network address
+    list<pair<Key, Entry>> lru;
+    map<Key, list<pair<Key, Entry>>::iterator> index;
+    size_t capacity;
+
+    static Key key(int family, const u_char *ip) {
+        Key k{};
+        k[0] = u_char(family);
+        memcpy(&k[1], ip, family == IPv4 ? 4 : 16);
+        return k;
+    }
+
+public:
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    explicit RangeCache(size_t capacity) : capacity(capacity) {}
+
+    // Networks in the cache never overlap, so only the one starting closest below ip can hold it.
+    Entry *Get(int family, const u_char *ip) {
+        auto it = index.upper_bound(key(family, ip));
+        if (it != index.begin()) {
+            auto &entry = (--it)->second->second;
+            if (entry.network.Family == family && prefixMatch(entry.network.Address, ip, entry.network.PrefixLength)) {
+                ++hits;
+                lru.splice(lru.begin(), lru, it->second);
+                return &entry;
+            }
         }
-        node = search((const u_char *) &addr4.s_addr, 32);
-    } else if (inet_pton(AF_INET6, addr.c_str(), &addr6)) {
-        if (!IsIPv6Support()) {
-            throw ErrNoSupportIPv6;
+        ++misses;
+        return nullptr;
+    }
+
+    Entry *Put(const Network &network, string_view record) {
+        auto k = key(network.Family, network.Address);
+        lru.emplace_front(k, Entry{network, record, {}});
+        auto it = index.find(k);
+        if (it != index.end()) {
+            lru.erase(it->second);
+        }
+        index[k] = lru.begin();
+        if (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return &lru.front().second;
+    }
+
+    ipdb::CacheStats Stats() const {
+        ipdb::CacheStats stats;
+        stats.Hits = hits;
+        stats.Misses = misses;
+        stats.Size = lru.size();
+        stats.Capacity = capacity;
+        return stats;
+    }
+};
+
+#ifdef IPDB_METRICS
+
+// Lookup counters, sharded so that each thread keeps to its own cache line-aligned shard.
+class ipdb::Meter {
+public:
+    struct alignas(64) Shard {
+        atomic<uint64_t> lookups[2]{};
+        atomic<uint64_t> results[7]{};
+        atomic<uint64_t> depth[129]{};
+        atomic<uint64_t> resolveBytes{};
+        atomic<uint64_t> latency[LookupMetrics::LatencyBuckets]{};
+        atomic<uint64_t> latencyNanoseconds{};
+    };
+
+    static const size_t shardCount = 32;
+    Shard shards[shardCount];
+
+    Shard &Local() {
+        static atomic<size_t> threads{0};
+        static thread_local size_t index = threads.fetch_add(1, memory_order_relaxed) % shardCount;
+        return shards[index];
+    }
+};
+
+static void bump(atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.fetch_add(n, memory_order_relaxed);
+}
+
+#endif
+
+// The metric hooks; without IPDB_METRICS they are empty and the timer never reads the clock.
+static void meterWalk([[maybe_unused]] ipdb::Meter *meter, [[maybe_unused]] int family, [[maybe_unused]] int depth,
+                      [[maybe_unused]] size_t resolved) {
+#ifdef IPDB_METRICS
+    auto &shard = meter->Local();
+    bump(shard.lookups[family == IPv4 ? 0 : 1]);
+    if (depth >= 0) {
+        bump(shard.depth[depth]);
+    }
+    if (resolved) {
+        bump(shard.resolveBytes, resolved + 2);
+    }
+#endif
+}
+
+static void meterResult([[maybe_unused]] ipdb::Meter *meter, [[maybe_unused]] ipdb::Status status) {
+#ifdef IPDB_METRICS
+    bump(meter->Local().results[int(status)]);
+#endif
+}
+
+// Counts the status of one lookup call and its time since construction.
+class LookupTimer {
+#ifdef IPDB_METRICS
+    ipdb::Meter *meter;
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+#endif
+public:
+    explicit LookupTimer([[maybe_unused]] ipdb::Meter *meter)
+#ifdef IPDB_METRICS
+            : meter(meter)
+#endif
+    {}
+
+    ipdb::Status operator()(ipdb::Status status) const {
+#ifdef IPDB_METRICS
+        auto ns = uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+        auto bucket = min(ns ? 64 - __builtin_clzll(ns) : 0, ipdb::LookupMetrics::LatencyBuckets - 1);
+        auto &shard = meter->Local();
+        bump(shard.results[int(status)]);
+        bump(shard.latency[bucket]);
+        bump(shard.latencyNanoseconds, ns);
+#endif
+        return status;
+    }
+};
+
+ipdb::LookupMetrics ipdb::Reader::Metrics() const {
+    LookupMetrics metrics;
+#ifdef IPDB_METRICS
+    metrics.Enabled = true;
+    for (auto &shard : meter->shards) {
+        auto sum = [](uint64_t *to, const atomic<uint64_t> *from, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                to[i] += from[i].load(memory_order_relaxed);
+            }
+        };
+        sum(metrics.Lookups, shard.lookups, 2);
+        sum(metrics.Results, shard.results, 7);
+        sum(metrics.Depth, shard.depth, 129);
+        sum(&metrics.ResolveBytes, &shard.resolveBytes, 1);
+        sum(metrics.Latency, shard.latency, LookupMetrics::LatencyBuckets);
+        sum(&metrics.LatencyNanoseconds, &shard.latencyNanoseconds, 1);
+    }
+#endif
+    return metrics;
+}
+
+string ipdb::LookupMetrics::Prometheus(const string &prefix) const {
+    ostringstream out;
+    out << "# HELP " << prefix << "_lookups_total Trie lookups by address family.\n"
+        << "# TYPE " << prefix << "_lookups_total counter\n"
+        << prefix << "_lookups_total{family=\"ipv4\"} " << Lookups[0] << "\n"
+        << prefix << "_lookups_total{family=\"ipv6\"} " << Lookups[1] << "\n";
+    static const char *statuses[] = {"ok", "ip_format", "no_support_language", "no_support_ipv4",
+                                     "no_support_ipv6", "data_not_exists", "database_error"};
+    out << "# HELP " << prefix << "_results_total Lookups by result.\n"
+        << "# TYPE " << prefix << "_results_total counter\n";
+    for (auto i = 0; i < 7; ++i) {
+        out << prefix << "_results_total{status=\"" << statuses[i] << "\"} " << Results[i] << "\n";
+    }
+    out << "# HELP " << prefix << "_resolve_bytes_total Record bytes read.\n"
+        << "# TYPE " << prefix << "_resolve_bytes_total counter\n"
+        << prefix << "_resolve_bytes_total " << ResolveBytes << "\n";
+    uint64_t count = 0, sum = 0;
+    out << "# HELP " << prefix << "_trie_depth Depth the trie walk stopped at.\n"
+        << "# TYPE " << prefix << "_trie_depth histogram\n";
+    for (auto depth = 0; depth <= 128; ++depth) {
+        count += Depth[depth];
+        sum += uint64_t(depth) * Depth[depth];
+        if (depth % 8 == 0 && depth > 0) {
+            out << prefix << "_trie_depth_bucket{le=\"" << depth << "\"} " << count << "\n";
+        }
+    }
+    out << prefix << "_trie_depth_bucket{le=\"+Inf\"} " << count << "\n"
+        << prefix << "_trie_depth_sum " << sum << "\n"
+        << prefix << "_trie_depth_count " << count << "\n";
+    count = 0;
+    out << "# HELP " << prefix << "_lookup_seconds Lookup latency: parse, trie walk and resolve.\n"
+        << "# TYPE " << prefix << "_lookup_seconds histogram\n";
+    for (auto i = 0; i < LatencyBuckets - 1; ++i) {
+        count += Latency[i];
+        out << prefix << "_lookup_seconds_bucket{le=\"" << double(uint64_t(1) << i) * 1e-9 << "\"} " << count << "\n";
+    }
+    count += Latency[LatencyBuckets - 1];
+    out << prefix << "_lookup_seconds_bucket{le=\"+Inf\"} " << count << "\n"
+        << prefix << "_lookup_seconds_sum " << double(LatencyNanoseconds) * 1e-9 << "\n"
+        << prefix << "_lookup_seconds_count " << count << "\n";
+    return out.str();
+}
+
+ipdb::RangeCache &ipdb::Reader::rangeCache() const {
+    struct Slot {
+        weak_ptr<const void> key;
+        unique_ptr<RangeCache> cache;
+    };
+    // one cache per thread per reader, even for readers sharing an image; the weak_ptr notices when the reader
+    // (and so its key) is freed and the key's address reused
+    static thread_local unordered_map<const void *, Slot> caches;
+    static thread_local const void *lastKey = nullptr;
+    static thread_local Slot *last = nullptr;
+    auto key = rangeCacheKey.get();
+    if (lastKey == key && !last->key.expired()) {
+        return *last->cache;
+    }
+    auto &slot = caches[key];
+    if (!slot.cache || slot.key.expired()) {
+        for (auto it = caches.begin(); it != caches.end();) {
+            if (it->first != key && it->second.key.expired()) {
+                it = caches.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        slot.key = rangeCacheKey;
+        slot.cache.reset(new RangeCache(rangeCacheSize));
+    }
+    lastKey = key;
+    last = &slot;
+    return *slot.cache;
+}
+
+ipdb::Status ipdb::Reader::find0(int family, const u_char *ip, InfoSlot **slot, string_view &record,
+                                  Network &network) const {
+    auto bitCount = family == IPv4 ? 32 : 128;
+    auto depth = 0;
+    if (rangeCacheSize == 0) {
+        auto node = search(ip, bitCount, depth);
+        if (node <= meta.NodeCount) {
+            meterWalk(meter.get(), family, depth, 0);
+            return Status::DataNotExists;
         }
-        node = search((const u_char *) &addr6.s6_addr, 128);
+        network = Network(family, ip, depth);
+        auto status = resolve(node, record);
+        meterWalk(meter.get(), family, depth, record.size());
+        return status;
+    }
+    auto &ranges = rangeCache();
+    auto entry = ranges.Get(family, ip);
+    if (!entry) {
+        auto node = search(ip, bitCount, depth);
+        if (node <= meta.NodeCount) {
+            meterWalk(meter.get(), family, depth, 0);
+            return Status::DataNotExists;
+        }
+        auto status = resolve(node, record);
+        meterWalk(meter.get(), family, depth, record.size());
+        if (status != Status::Ok) {
+            return status;
+        }
+        entry = ranges.Put(Network(family, ip, depth), record);
     } else {
-        throw ErrIPFormat;
+        meterWalk(meter.get(), family, -1, 0);
     }
-    auto body = resolve(node);
-    return body;
+    if (slot) {
+        *slot = &entry->info;
+    }
+    record = entry->record;
+    network = entry->network;
+    return Status::Ok;
+}
+
+ipdb::Status ipdb::Reader::find0(const string &addr, InfoSlot **slot, string_view &record, Network &network) const {
+    Address parsed;
+    // like inet_pton, the text ends at the first NUL
+    switch (ParseAddress(string_view(addr.c_str(), strnlen(addr.c_str(), addr.size())), parsed)) {
+        case IPv4:
+            if (!IsIPv4Support()) {
+                return Status::NoSupportIPv4;
+            }
+            return find0(IPv4, parsed.Bytes, slot, record, network);
+        case IPv6:
+            if (!IsIPv6Support()) {
+                return Status::NoSupportIPv6;
+            }
+            return find0(IPv6, parsed.Bytes, slot, record, network);
+        default:
+            return Status::IPFormat;
+    }
+}
+
+ipdb::Status ipdb::Reader::find0(const in_addr &addr, InfoSlot **slot, string_view &record, Network &network) const {
+    if (!IsIPv4Support()) {
+        return Status::NoSupportIPv4;
+    }
+    return find0(IPv4, (const u_char *) &addr.s_addr, slot, record, network);
+}
+
+ipdb::Status ipdb::Reader::find0(const in6_addr &addr, InfoSlot **slot, string_view &record, Network &network) const {
+    if (!IsIPv6Support()) {
+        return Status::NoSupportIPv6;
+    }
+    return find0(IPv6, (const u_char *) &addr.s6_addr, slot, record, network);
+}
+
+ipdb::Status ipdb::Reader::find0(uint32_t addr, InfoSlot **slot, string_view &record, Network &network) const {
+    struct in_addr addr4{};
+    addr4.s_addr = htonl(addr);
+    return find0(addr4, slot, record, network);
+}
+
+ipdb::Status ipdb::Reader::find0(const sockaddr_storage &addr, InfoSlot **slot, string_view &record, Network &network) const {
+    if (addr.ss_family == AF_INET) {
+        return find0(((const sockaddr_in *) &addr)->sin_addr, slot, record, network);
+    } else if (addr.ss_family == AF_INET6) {
+        return find0(((const sockaddr_in6 *) &addr)->sin6_addr, slot, record, network);
+    }
+    return Status::IPFormat;
+}
+
+template<typename T>
+ipdb::Status ipdb::Reader::view0(const T &addr, const string &language, RecordView &out, InfoSlot **slot) const {
+    LookupTimer done(meter.get());
+    auto lang = meta.Languages.find(language);
+    if (lang == meta.Languages.end()) {
+        return done(Status::NoSupportLanguage);
+    }
+    string_view record;
+    Network network;
+    auto status = find0(addr, slot, record, network);
+    if (status != Status::Ok) {
+        return done(status);
+    }
+    return done(out.assign(record, lang->second, meta.Fields, network) ? Status::Ok : Status::DatabaseError);
+}
+
+template<typename T>
+ipdb::RecordView ipdb::Reader::view1(const T &addr, const string &language, InfoSlot **slot) const {
+    RecordView view;
+    check(view0(addr, language, view, slot));
+    return view;
+}
+
+template<typename T>
+vector<string> ipdb::Reader::find1(const T &addr, const string &language) const {
+    return view1(addr, language).ToVector();
+}
+
+template<typename T>
+ipdb::Status ipdb::Reader::tryFind0(const T &addr, const string &language, vector<string> &result) const {
+    RecordView view;
+    auto status = view0(addr, language, view);
+    if (status == Status::Ok) {
+        result = view.ToVector();
+    }
+    return status;
+}
+
+ipdb::RecordView ipdb::Reader::FindView(const string &addr, const string &language) const {
+    return view1(addr, language);
+}
+
+ipdb::RecordView ipdb::Reader::FindView(const in_addr &addr, const string &language) const {
+    return view1(addr, language);
+}
+
+ipdb::RecordView ipdb::Reader::FindView(const in6_addr &addr, const string &language) const {
+    return view1(addr, language);
+}
+
+ipdb::RecordView ipdb::Reader::FindView(uint32_t addr, const string &language) const {
+    return view1(addr, language);
+}
+
+ipdb::RecordView ipdb::Reader::FindView(const sockaddr_storage &addr, const string &language) const {
+    return view1(addr, language);
+}
+
+ipdb::Status ipdb::Reader::TryFind(const string &addr, const string &language, vector<string> &result) const {
+    return tryFind0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFind(const in_addr &addr, const string &language, vector<string> &result) const {
+    return tryFind0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFind(const in6_addr &addr, const string &language, vector<string> &result) const {
+    return tryFind0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFind(uint32_t addr, const string &language, vector<string> &result) const {
+    return tryFind0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFind(const sockaddr_storage &addr, const string &language, vector<string> &result) const {
+    return tryFind0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFindView(const string &addr, const string &language, RecordView &result) const {
+    return view0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFindView(const in_addr &addr, const string &language, RecordView &result) const {
+    return view0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFindView(const in6_addr &addr, const string &language, RecordView &result) const {
+    return view0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFindView(uint32_t addr, const string &language, RecordView &result) const {
+    return view0(addr, language, result);
+}
+
+ipdb::Status ipdb::Reader::TryFindView(const sockaddr_storage &addr, const string &language, RecordView &result) const {
+    return view0(addr, language, result);
+}
+
+// runs f(part, begin, end) over threads contiguous parts of [0, count)
+template<typename F>
+static void parallelFor(size_t count, size_t threads, F f) {
+    vector<thread> workers;
+    for (size_t part = 0; part < threads; ++part) {
+        workers.emplace_back(f, part, count * part / threads, count * (part + 1) / threads);
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void ipdb::Reader::buildTables(const vector<string> &languages, int threads) {
+    auto begin = chrono::steady_clock::now();
+    for (auto node = 0; node < meta.NodeCount; ++node) {
+        for (auto bit = 0; bit < 2; ++bit) {
+            auto child = readNode(node, bit);
+            if (child > meta.NodeCount) {
+                string_view record;
+                check(resolve(child, record));
+                tableRecords.push_back(uint32_t((const u_char *) record.data() - data));
+            }
+        }
+    }
+    sort(tableRecords.begin(), tableRecords.end());
+    tableRecords.erase(unique(tableRecords.begin(), tableRecords.end()), tableRecords.end());
+
+    auto rows = tableRecords.size();
+    size_t parts = threads > 0 ? threads : max(1u, thread::hardware_concurrency());
+    parts = max<size_t>(1, min(parts, rows / 4096));
+    for (auto &language : languages) {
+        auto lang = meta.Languages.find(language);
+        if (lang == meta.Languages.end()) {
+            throw ErrNoSupportLanguage;
+        }
+        auto &table = tables[language];
+        table.fields = meta.Fields;
+        table.columns.assign(meta.Fields.size(), vector<uint32_t>(rows));
+        // each part interns into its own pool, the pools are merged once the parts are done
+        vector<vector<string_view>> pools(parts);
+        atomic<bool> failed{false};
+        parallelFor(rows, parts, [&](size_t part, size_t first, size_t last) {
+            unordered_map<string_view, uint32_t> ids;
+            for (auto row = first; row < last; ++row) {
+                auto offset = tableRecords[row];
+                string_view record((const char *) data + offset, (data[offset - 2] << 8) | data[offset - 1]);
+                RecordView view;
+                if (!view.assign(record, lang->second, meta.Fields, Network())) {
+                    failed = true;
+                    return;
+                }
+                auto body = view.Record();
+                string_view::size_type begin = 0;
+                for (size_t i = 0; i < meta.Fields.size(); ++i) {
+                    auto end = body.find('\t', begin);
+                    auto value = body.substr(begin, end == string_view::npos ? string_view::npos : end - begin);
+                    auto id = ids.find(value);
+                    if (id == ids.end()) {
+                        id = ids.emplace(value, uint32_t(pools[part].size())).first;
+                        pools[part].push_back(value);
+                    }
+                    table.columns[i][row] = id->second;
+                    begin = end + 1;
+                }
+            }
+        });
+        if (failed) {
+            throw ErrDatabaseError;
+        }
+        vector<vector<uint32_t>> remap(parts);
+        unordered_map<string_view, uint32_t> ids;
+        for (size_t part = 0; part < parts; ++part) {
+            for (auto &value : pools[part]) {
+                auto id = ids.find(value);
+                if (id == ids.end()) {
+                    id = ids.emplace(value, uint32_t(table.strings.size())).first;
+                    table.strings.push_back(value);
+                }
+                remap[part].push_back(id->second);
+            }
+        }
+        table.strings.shrink_to_fit();
+        parallelFor(rows, parts, [&](size_t part, size_t first, size_t last) {
+            for (auto &column : table.columns) {
+                for (auto row = first; row < last; ++row) {
+                    column[row] = remap[part][column[row]];
+                }
+            }
+        });
+    }
+    tableSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+template<typename T>
+ipdb::Status ipdb::Reader::row0(const T &addr, const string &language, uint32_t &row) const {
+    LookupTimer done(meter.get());
+    if (tables.find(language) == tables.end()) {
+        return done(Status::NoSupportLanguage);
+    }
+    string_view record;
+    Network network;
+    auto status = find0(addr, nullptr, record, network);
+    if (status != Status::Ok) {
+        return done(status);
+    }
+    auto offset = uint32_t((const u_char *) record.data() - data);
+    auto it = lower_bound(tableRecords.begin(), tableRecords.end(), offset);
+    if (it == tableRecords.end() || *it != offset) {
+        return done(Status::DatabaseError);
+    }
+    row = uint32_t(it - tableRecords.begin());
+    return done(Status::Ok);
+}
+
+ipdb::Status ipdb::Reader::TryFindRow(const string &addr, const string &language, uint32_t &row) const {
+    return row0(addr, language, row);
+}
+
+ipdb::Status ipdb::Reader::TryFindRow(const in_addr &addr, const string &language, uint32_t &row) const {
+    return row0(addr, language, row);
+}
+
+ipdb::Status ipdb::Reader::TryFindRow(const in6_addr &addr, const string &language, uint32_t &row) const {
+    return row0(addr, language, row);
+}
+
+ipdb::Status ipdb::Reader::TryFindRow(uint32_t addr, const string &language, uint32_t &row) const {
+    return row0(addr, language, row);
+}
+
+ipdb::Status ipdb::Reader::TryFindRow(const sockaddr_storage &addr, const string &language, uint32_t &row) const {
+    return row0(addr, language, row);
+}
+
+const ipdb::RecordTable &ipdb::Reader::Table(const string &language) const {
+    auto table = tables.find(language);
+    if (table == tables.end()) {
+        throw ErrNoSupportLanguage;
+    }
+    return table->second;
+}
+
+static const size_t hugePageSize = 2 << 20;
+
+ipdb::MemoryStats ipdb::Reader::ImageStats() const {
+    auto stats = memory;
+    // sum the huge page counters of the mappings inside the image, whose own mappings end at most at the next
+    // 2 MB boundary; a mapping that also holds other data (a heap copy) is not counted
+    ifstream smaps("/proc/self/smaps");
+    auto begin = uintptr_t(image.get());
+    auto end = begin + ((memory.Bytes + hugePageSize - 1) & ~(hugePageSize - 1));
+    auto inside = false;
+    string line;
+    while (getline(smaps, line)) {
+        uintptr_t low, high;
+        if (sscanf(line.c_str(), "%lx-%lx ", &low, &high) == 2) {
+            inside = begin <= low && high <= end;
+            continue;
+        }
+        size_t kb;
+        char name[64];
+        if (inside && sscanf(line.c_str(), "%63[^:]: %zu kB", name, &kb) == 2 &&
+            (!strcmp(name, "AnonHugePages") || !strcmp(name, "FilePmdMapped") || !strcmp(name, "ShmemPmdMapped") ||
+             !strcmp(name, "Private_Hugetlb") || !strcmp(name, "Shared_Hugetlb"))) {
+            stats.HugePageBytes += kb * 1024;
+        }
+    }
+    stats.HugePageBytes = min(stats.HugePageBytes, memory.Bytes);
+    return stats;
+}
+
+ipdb::TableStats ipdb::Reader::RecordTableStats() const {
+    TableStats stats;
+    stats.Records = tableRecords.size();
+    stats.Bytes = tableRecords.capacity() * sizeof(uint32_t);
+    for (auto &table : tables) {
+        stats.Strings += table.second.strings.size();
+        stats.Bytes += table.second.Bytes();
+    }
+    stats.BuildSeconds = tableSeconds;
+    return stats;
+}
+
+size_t ipdb::RecordTable::Rows() const {
+    return columns.empty() ? 0 : columns[0].size();
+}
+
+const vector<string> &ipdb::RecordTable::Fields() const {
+    return fields;
+}
+
+uint32_t ipdb::RecordTable::Id(uint32_t row, size_t field) const {
+    return columns[field][row];
+}
+
+string_view ipdb::RecordTable::Get(uint32_t row, size_t field) const {
+    if (field >= columns.size() || row >= columns[field].size()) {
+        return {};
+    }
+    return strings[columns[field][row]];
+}
+
+string_view ipdb::RecordTable::Get(uint32_t row, string_view name) const {
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (fields[i] == name) {
+            return Get(row, i);
+        }
+    }
+    return {};
+}
+
+size_t ipdb::RecordTable::Bytes() const {
+    auto bytes = strings.capacity() * sizeof(string_view);
+    for (auto &column : columns) {
+        bytes += column.capacity() * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+ipdb::PreparedQuery ipdb::Reader::Prepare(const string &language, const vector<string> &fields) const {
+    auto lang = meta.Languages.find(language);
+    if (lang == meta.Languages.end()) {
+        throw ErrNoSupportLanguage;
+    }
+    PreparedQuery query;
+    query.reader = this;
+    query.fields = fields.empty() ? meta.Fields : fields;
+    for (size_t i = 0; i < query.fields.size(); ++i) {
+        auto field = std::find(meta.Fields.begin(), meta.Fields.end(), query.fields[i]);
+        if (field == meta.Fields.end()) {
+            throw ErrNoSupportField;
+        }
+        query.columns.emplace_back(lang->second + int(field - meta.Fields.begin()), i);
+    }
+    sort(query.columns.begin(), query.columns.end());
+    return query;
+}
+
+template<typename T>
+ipdb::Status ipdb::PreparedQuery::find0(const T &addr, vector<string_view> &result) const {
+    LookupTimer done(reader->meter.get());
+    string_view record;
+    Network network;
+    auto status = reader->find0(addr, nullptr, record, network);
+    if (status != Status::Ok) {
+        return done(status);
+    }
+    // walk the tabs only up to the last requested column
+    result.resize(fields.size());
+    string_view::size_type begin = 0;
+    auto column = 0;
+    for (auto &c : columns) {
+        for (; column < c.first; ++column) {
+            begin = record.find('\t', begin);
+            if (begin == string_view::npos) {
+                return done(Status::DatabaseError);
+            }
+            ++begin;
+        }
+        auto end = record.find('\t', begin);
+        result[c.second] = record.substr(begin, end == string_view::npos ? string_view::npos : end - begin);
+    }
+    return done(Status::Ok);
+}
+
+template<typename T>
+vector<string> ipdb::PreparedQuery::find1(const T &addr) const {
+    vector<string_view> result;
+    check(find0(addr, result));
+    return {result.begin(), result.end()};
+}
+
+const vector<string> &ipdb::PreparedQuery::Fields() const {
+    return fields;
+}
+
+vector<string> ipdb::PreparedQuery::Find(const string &addr) const {
+    return find1(addr);
+}
+
+vector<string> ipdb::PreparedQuery::Find(const in_addr &addr) const {
+    return find1(addr);
+}
+
+vector<string> ipdb::PreparedQuery::Find(const in6_addr &addr) const {
+    return find1(addr);
+}
+
+vector<string> ipdb::PreparedQuery::Find(uint32_t addr) const {
+    return find1(addr);
+}
+
+vector<string> ipdb::PreparedQuery::Find(const sockaddr_storage &addr) const {
+    return find1(addr);
+}
+
+ipdb::Status ipdb::PreparedQuery::TryFind(const string &addr, vector<string_view> &result) const {
+    return find0(addr, result);
+}
+
+ipdb::Status ipdb::PreparedQuery::TryFind(const in_addr &addr, vector<string_view> &result) const {
+    return find0(addr, result);
+}
+
+ipdb::Status ipdb::PreparedQuery::TryFind(const in6_addr &addr, vector<string_view> &result) const {
+    return find0(addr, result);
+}
+
+ipdb::Status ipdb::PreparedQuery::TryFind(uint32_t addr, vector<string_view> &result) const {
+    return find0(addr, result);
+}
+
+ipdb::Status ipdb::PreparedQuery::TryFind(const sockaddr_storage &addr, vector<string_view> &result) const {
+    return find0(addr, result);
+}
+
+class ipdb::RecordCache {
+    struct Shard {
+        mutex lock;
+        list<pair<const char *, shared_ptr<const void>>> lru;
+        unordered_map<const char *, list<pair<const char *, shared_ptr<const void>>>::iterator> index;
+    };
+    static const size_t shardCount = 16;
+    Shard shards[shardCount];
+    size_t shardCapacity;
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+
+    Shard &shard(const char *key) {
+        return shards[(reinterpret_cast<uintptr_t>(key) >> 4) % shardCount];
+    }
+
+public:
+    explicit RecordCache(size_t capacity) : shardCapacity((capacity + shardCount - 1) / shardCount) {}
+
+    shared_ptr<const void> Get(const char *key) {
+        auto &s = shard(key);
+        lock_guard<mutex> guard(s.lock);
+        auto it = s.index.find(key);
+        if (it == s.index.end()) {
+            misses.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+        hits.fetch_add(1, memory_order_relaxed);
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        return it->second->second;
+    }
+
+    void Put(const char *key, shared_ptr<const void> value) {
+        auto &s = shard(key);
+        lock_guard<mutex> guard(s.lock);
+        if (s.index.find(key) != s.index.end()) {
+            return;
+        }
+        s.lru.emplace_front(key, move(value));
+        s.index[key] = s.lru.begin();
+        if (s.lru.size() > shardCapacity) {
+            s.index.erase(s.lru.back().first);
+            s.lru.pop_back();
+        }
+    }
+
+    ipdb::CacheStats Stats() {
+        ipdb::CacheStats stats;
+        stats.Hits = hits.load(memory_order_relaxed);
+        stats.Misses = misses.load(memory_order_relaxed);
+        stats.Capacity = shardCapacity * shardCount;
+        for (auto &s : shards) {
+            lock_guard<mutex> guard(s.lock);
+            stats.Size += s.lru.size();
+        }
+        return stats;
+    }
+};
+
+template<typename Info, typename T>
+ipdb::Status ipdb::Reader::findInfo0(const T &addr, const string &language, const Schema<Info> &schema,
+                                      shared_ptr<const Info> &out) const {
+    InfoSlot *slot = nullptr;
+    RecordView view;
+    auto status = view0(addr, language, view, &slot);
+    if (status != Status::Ok) {
+        return status;
+    }
+    // the language's columns start at a distinct place in the image, so this keys record and language
+    auto key = view.Record().data();
+    if (slot && slot->key == key) {
+        out = static_pointer_cast<const Info>(slot->value);
+        return Status::Ok;
+    }
+    shared_ptr<const Info> info;
+    auto hit = cache ? cache->Get(key) : nullptr;
+    if (hit) {
+        info = static_pointer_cast<const Info>(hit);
+    } else {
+        info = make_shared<const Info>(view, schema);
+        if (cache) {
+            cache->Put(key, info);
+        }
+    }
+    if (slot) {
+        slot->key = key;
+        slot->value = info;
+    }
+    out = move(info);
+    return Status::Ok;
+}
+
+template<typename Info, typename T>
+shared_ptr<const Info> ipdb::Reader::findInfo(const T &addr, const string &language, const Schema<Info> &schema) const {
+    shared_ptr<const Info> info;
+    check(findInfo0(addr, language, schema, info));
+    return info;
+}
+
+template<typename Info, typename T>
+ipdb::Status ipdb::Reader::info0(const T &addr, const string &language, const Schema<Info> &schema, Info &out) const {
+    if (cache || rangeCacheSize > 0) {
+        shared_ptr<const Info> info;
+        auto status = findInfo0(addr, language, schema, info);
+        if (status == Status::Ok) {
+            out = *info;
+        }
+        return status;
+    }
+    RecordView view;
+    auto status = view0(addr, language, view);
+    if (status == Status::Ok) {
+        out = Info(view, schema);
+    }
+    return status;
+}
+
+template<typename Info, typename T>
+Info ipdb::Reader::info1(const T &addr, const string &language, const Schema<Info> &schema) const {
+    Info info;
+    check(info0(addr, language, schema, info));
+    return info;
+}
+
+static const u_char *ipBytes(const in_addr &addr) {
+    return (const u_char *) &addr.s_addr;
+}
+
+static const u_char *ipBytes(const in6_addr &addr) {
+    return (const u_char *) &addr.s6_addr;
+}
+
+template<typename T>
+void ipdb::Reader::batch(const T *addrs, size_t count, int bitCount, int offset, RecordView *out) const {
+    const size_t width = 32;
+    struct Walk {
+        size_t index;
+        int node;
+        int depth;
+    } walks[width];
+    size_t next = 0, active = 0;
+    for (; active < width && next < count; ++active, ++next) {
+        walks[active].index = next;
+        walks[active].node = start(ipBytes(addrs[next]), bitCount, walks[active].depth);
+    }
+    while (active > 0) {
+        for (size_t w = 0; w < active;) {
+            auto &walk = walks[w];
+            if (walk.node > meta.NodeCount || walk.depth == bitCount) {
+                auto family = bitCount == 32 ? IPv4 : IPv6;
+                if (walk.node > meta.NodeCount) {
+                    string_view record;
+                    check(resolve(walk.node, record));
+                    meterWalk(meter.get(), family, walk.depth, record.size());
+                    meterResult(meter.get(), Status::Ok);
+                    out[walk.index] = RecordView(record, offset, meta.Fields,
+                                                 Network(family, ipBytes(addrs[walk.index]), walk.depth));
+                } else {
+                    meterWalk(meter.get(), family, walk.depth, 0);
+                    meterResult(meter.get(), Status::DataNotExists);
+                    out[walk.index] = RecordView();
+                }
+                if (next < count) {
+                    walk.index = next++;
+                    walk.node = start(ipBytes(addrs[walk.index]), bitCount, walk.depth);
+                } else {
+                    walk = walks[--active];
+                }
+                continue;
+            }
+            auto ip = ipBytes(addrs[walk.index]);
+            auto i = walk.depth++;
+            walk.node = readNode(walk.node, ((0xFF & int(ip[i >> 3])) >> uint(7 - (i % 8))) & 1);
+            if (walk.node < meta.NodeCount) {
+                __builtin_prefetch(data + walk.node * 8);
+            }
+            ++w;
+        }
+    }
+}
+
+void ipdb::Reader::FindBatch(const in_addr *addrs, size_t count, const string &language, RecordView *out) const {
+    auto lang = meta.Languages.find(language);
+    if (lang == meta.Languages.end()) {
+        throw ErrNoSupportLanguage;
+    }
+    if (!IsIPv4Support()) {
+        throw ErrNoSupportIPv4;
+    }
+    batch(addrs, count, 32, lang->second, out);
+}
+
+void ipdb::Reader::FindBatch(const in6_addr *addrs, size_t count, const string &language, RecordView *out) const {
+    auto lang = meta.Languages.find(language);
+    if (lang == meta.Languages.end()) {
+        throw ErrNoSupportLanguage;
+    }
+    if (!IsIPv6Support()) {
+        throw ErrNoSupportIPv6;
+    }
+    batch(addrs, count, 128, lang->second, out);
+}
+
+void ipdb::Reader::FindBatch(const Address *addrs, size_t count, const string &language, RecordView *out) const {
+    auto lang = meta.Languages.find(language);
+    if (lang == meta.Languages.end()) {
+        throw ErrNoSupportLanguage;
+    }
+    vector<in_addr> v4;
+    vector<in6_addr> v6;
+    vector<size_t> v4index, v6index;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = RecordView();
+        if (addrs[i].Family == IPv4 && IsIPv4Support()) {
+            v4.emplace_back();
+            memcpy(&v4.back(), addrs[i].Bytes, 4);
+            v4index.push_back(i);
+        } else if (addrs[i].Family == IPv6 && IsIPv6Support()) {
+            v6.emplace_back();
+            memcpy(&v6.back(), addrs[i].Bytes, 16);
+            v6index.push_back(i);
+        }
+    }
+    vector<RecordView> views(max(v4.size(), v6.size()));
+    batch(v4.data(), v4.size(), 32, lang->second, views.data());
+    for (size_t i = 0; i < v4.size(); ++i) {
+        out[v4index[i]] = views[i];
+    }
+    batch(v6.data(), v6.size(), 128, lang->second, views.data());
+    for (size_t i = 0; i < v6.size(); ++i) {
+        out[v6index[i]] = views[i];
+    }
+}
+
+// Runs f(begin, end) over [0, count) in chunks of chunkSize on threads workers, the caller being one of them.
+// Each worker starts with a contiguous share of the chunks and takes them from the front; once it runs out
+// it steals the back half of the largest remaining share.
+template<typename F>
+static void parallelChunks(size_t count, size_t chunkSize, size_t threads, F f) {
+    struct alignas(64) Share {
+        mutex lock;
+        size_t begin = 0; // chunk indices
+        size_t end = 0;
+    };
+    auto chunks = (count + chunkSize - 1) / chunkSize;
+    threads = max<size_t>(1, min(threads, chunks));
+    vector<Share> shares(threads);
+    for (size_t w = 0; w < threads; ++w) {
+        shares[w].begin = chunks * w / threads;
+        shares[w].end = chunks * (w + 1) / threads;
+    }
+    mutex errorLock;
+    exception_ptr error;
+    auto work = [&](size_t w) {
+        auto &own = shares[w];
+        for (;;) {
+            size_t chunk;
+            {
+                lock_guard<mutex> guard(own.lock);
+                chunk = own.begin < own.end ? own.begin++ : SIZE_MAX;
+            }
+            if (chunk == SIZE_MAX) {
+                size_t victim = w, most = 0;
+                for (size_t v = 0; v < threads; ++v) {
+                    lock_guard<mutex> guard(shares[v].lock); // a hint, rechecked below
+                    if (shares[v].end - shares[v].begin > most) {
+                        most = shares[v].end - shares[v].begin;
+                        victim = v;
+                    }
+                }
+                if (most == 0) {
+                    return;
+                }
+                size_t first, last;
+                {
+                    lock_guard<mutex> guard(shares[victim].lock);
+                    auto &share = shares[victim];
+                    if (share.begin == share.end) {
+                        continue;
+                    }
+                    first = share.begin + (share.end - share.begin) / 2;
+                    last = share.end;
+                    share.end = first;
+                }
+                lock_guard<mutex> guard(own.lock);
+                own.begin = first;
+                own.end = last;
+                continue;
+            }
+            try {
+                f(chunk * chunkSize, min(count, (chunk + 1) * chunkSize));
+            } catch (...) {
+                lock_guard<mutex> guard(errorLock);
+                if (!error) {
+                    error = current_exception();
+                }
+            }
+        }
+    };
+    vector<thread> workers;
+    for (size_t w = 1; w < threads; ++w) {
+        workers.emplace_back(work, w);
+    }
+    work(0);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        rethrow_exception(error);
+    }
+}
+
+template<typename T>
+void ipdb::Reader::parallelFind(const T *addrs, size_t count, const string &language, RecordView *out,
+                                int threads) const {
+    size_t workers = threads > 0 ? threads : max(1u, thread::hardware_concurrency());
+    parallelChunks(count, 4096, workers, [&](size_t begin, size_t end) {
+        FindBatch(addrs + begin, end - begin, language, out + begin);
+    });
+}
+
+void ipdb::Reader::ParallelFind(const in_addr *addrs, size_t count, const string &language, RecordView *out,
+                                int threads) const {
+    FindBatch(addrs, 0, language, out); // throws for an unsupported language or family before any thread starts
+    parallelFind(addrs, count, language, out, threads);
+}
+
+void ipdb::Reader::ParallelFind(const in6_addr *addrs, size_t count, const string &language, RecordView *out,
+                                int threads) const {
+    FindBatch(addrs, 0, language, out);
+    parallelFind(addrs, count, language, out, threads);
+}
+
+void ipdb::Reader::ParallelFind(const Address *addrs, size_t count, const string &language, RecordView *out,
+                                int threads) const {
+    FindBatch(addrs, 0, language, out);
+    parallelFind(addrs, count, language, out, threads);
+}
+
+ipdb::LeafIterator ipdb::Reader::leaves(int family, const string &language) const {
+    auto lang = meta.Languages.find(language);
+    if (lang == meta.Languages.end()) {
+        throw ErrNoSupportLanguage;
+    }
+    LeafIterator it;
+    it.reader = this;
+    it.family = family;
+    it.offset = lang->second;
+    LeafIterator::Frame root{};
+    if (family == IPv4) {
+        if (!IsIPv4Support()) {
+            throw ErrNoSupportIPv4;
+        }
+        root.node = v4offset;
+    } else if (family == IPv6) {
+        if (!IsIPv6Support()) {
+            throw ErrNoSupportIPv6;
+        }
+        root.node = 0;
+    } else {
+        throw ErrIPFormat;
+    }
+    it.stack.push_back(root);
+    return it;
+}
+
+ipdb::LeafIterator ipdb::Reader::Leaves(int family, const string &language) const {
+    return leaves(family, language);
+}
+
+vector<ipdb::LeafIterator> ipdb::Reader::SplitLeaves(int family, const string &language, int splitBits) const {
+    auto whole = leaves(family, language);
+    auto bitCount = family == IPv4 ? 32 : 128;
+    if (splitBits < 0 || splitBits > bitCount) {
+        throw ErrReaderOptions;
+    }
+    vector<LeafIterator::Frame> frames = whole.stack;
+    for (auto depth = 0; depth < splitBits; ++depth) {
+        vector<LeafIterator::Frame> next;
+        for (auto &f : frames) {
+            if (family == IPv6 && f.depth == 96 && f.node == v4offset && IsIPv4Support()) {
+                continue;
+            }
+            if (f.node >= meta.NodeCount) {
+                next.push_back(f);
+                continue;
+            }
+            for (auto bit = 0; bit < 2; ++bit) {
+                auto child = f;
+                child.node = readNode(f.node, bit);
+                child.depth = f.depth + 1;
+                child.ip[f.depth >> 3] |= bit << uint(7 - (f.depth % 8));
+                next.push_back(child);
+            }
+        }
+        frames = move(next);
+    }
+    vector<LeafIterator> result;
+    for (auto &f : frames) {
+        auto it = whole;
+        it.stack.assign(1, f);
+        result.push_back(move(it));
+    }
+    return result;
+}
+
+bool ipdb::LeafIterator::Next(Network &network, RecordView &record) {
+    auto &meta = reader->meta;
+    auto bitCount = family == IPv4 ? 32 : 128;
+    while (!stack.empty()) {
+        auto f = stack.back();
+        stack.pop_back();
+        if (f.node > meta.NodeCount) {
+            network = Network(family, f.ip, f.depth);
+            string_view body;
+            check(reader->resolve(f.node, body));
+            record = RecordView(body, offset, meta.Fields, network);
+            return true;
+        }
+        if (f.node == meta.NodeCount || f.depth == bitCount) {
+            continue;
+        }
+        if (family == IPv6 && f.depth == 96 && f.node == reader->v4offset && reader->IsIPv4Support()) {
+            continue;
+        }
+        for (auto bit = 1; bit >= 0; --bit) {
+            auto child = f;
+            child.node = reader->readNode(f.node, bit);
+            child.depth = f.depth + 1;
+            child.ip[f.depth >> 3] |= bit << uint(7 - (f.depth % 8));
+            stack.push_back(child);
+        }
+    }
+    return false;
+}
+
+template<typename T>
+static T loadAddress(const u_char *bytes) {
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+template<typename T>
+static void storeAddress(T value, u_char *bytes) {
+    for (auto i = sizeof(T); i-- > 0; value >>= 8) {
+        bytes[i] = u_char(value);
+    }
+}
+
+template<typename T>
+static T hostBits(int prefixLength) {
+    return prefixLength >= int(sizeof(T) * 8) ? T(0) : ~T(0) >> uint(prefixLength);
+}
+
+template<typename T>
+static void addRange(vector<pair<T, T>> &ranges, T first, T last) {
+    if (!ranges.empty() && ranges.back().second + 1 == first) {
+        ranges.back().second = last;
+    } else {
+        ranges.emplace_back(first, last);
+    }
+}
+
+template<typename T>
+static bool containsAddress(const vector<pair<T, T>> &ranges, T addr) {
+    auto it = upper_bound(ranges.begin(), ranges.end(), addr, [](T a, const pair<T, T> &r) { return a < r.first; });
+    return it != ranges.begin() && prev(it)->second >= addr;
+}
+
+template<typename T>
+static vector<pair<T, T>> uniteRanges(const vector<pair<T, T>> &a, const vector<pair<T, T>> &b) {
+    vector<pair<T, T>> out;
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        auto &r = j == b.size() || (i < a.size() && a[i].first < b[j].first) ? a[i++] : b[j++];
+        if (!out.empty() && (out.back().second >= r.first || out.back().second + 1 == r.first)) {
+            out.back().second = max(out.back().second, r.second);
+        } else {
+            out.push_back(r);
+        }
+    }
+    return out;
+}
+
+template<typename T>
+static vector<pair<T, T>> intersectRanges(const vector<pair<T, T>> &a, const vector<pair<T, T>> &b) {
+    vector<pair<T, T>> out;
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        auto first = max(a[i].first, b[j].first), last = min(a[i].second, b[j].second);
+        if (first <= last) {
+            out.emplace_back(first, last);
+        }
+        if (a[i].second < b[j].second) {
+            ++i;
+        } else {
+            ++j;
+        }
+    }
+    return out;
+}
+
+template<typename T>
+static vector<pair<T, T>> subtractRanges(const vector<pair<T, T>> &a, const vector<pair<T, T>> &b) {
+    vector<pair<T, T>> out;
+    size_t j = 0;
+    for (auto &r : a) {
+        while (j < b.size() && b[j].second < r.first) {
+            ++j;
+        }
+        auto first = r.first;
+        auto covered = false;
+        for (auto k = j; k < b.size() && b[k].first <= r.second; ++k) {
+            if (b[k].first > first) {
+                out.emplace_back(first, b[k].first - 1);
+            }
+            if (b[k].second >= r.second) {
+                covered = true;
+                break;
+            }
+            first = b[k].second + 1;
+        }
+        if (!covered) {
+            out.emplace_back(first, r.second);
+        }
+    }
+    return out;
+}
+
+// each range split into the largest aligned blocks, left to right
+template<typename T>
+static void rangeNetworks(const vector<pair<T, T>> &ranges, int family, vector<ipdb::Network> &out) {
+    const int bitCount = sizeof(T) * 8;
+    for (auto &r : ranges) {
+        for (auto first = r.first;;) {
+            auto size = 0;
+            while (size < bitCount && !((first >> uint(size)) & 1)) {
+                ++size;
+            }
+            while (size > 0 && r.second - first < hostBits<T>(bitCount - size)) {
+                --size;
+            }
+            u_char ip[16]{};
+            storeAddress(first, ip);
+            out.emplace_back(family, ip, bitCount - size);
+            auto last = first | hostBits<T>(bitCount - size);
+            if (last >= r.second) {
+                break;
+            }
+            first = last + 1;
+        }
+    }
+}
+
+void ipdb::RangeSet::add(const Network &network) {
+    if (network.Family == IPv4) {
+        auto first = loadAddress<uint32_t>(network.Address);
+        addRange(v4, first, first | hostBits<uint32_t>(network.PrefixLength));
+    } else {
+        auto first = loadAddress<unsigned __int128>(network.Address);
+        addRange(v6, first, first | hostBits<unsigned __int128>(network.PrefixLength));
+    }
+}
+
+void ipdb::RangeSet::append(const RangeSet &other) {
+    for (auto &r : other.v4) {
+        addRange(v4, r.first, r.second);
+    }
+    for (auto &r : other.v6) {
+        addRange(v6, r.first, r.second);
+    }
+}
+
+bool ipdb::RangeSet::Empty() const {
+    return v4.empty() && v6.empty();
+}
+
+size_t ipdb::RangeSet::Size() const {
+    return v4.size() + v6.size();
+}
+
+bool ipdb::RangeSet::Contains(const in_addr &addr) const {
+    return containsAddress(v4, loadAddress<uint32_t>((const u_char *) &addr.s_addr));
+}
+
+bool ipdb::RangeSet::Contains(const in6_addr &addr) const {
+    return containsAddress(v6, loadAddress<unsigned __int128>(addr.s6_addr));
+}
+
+ipdb::RangeSet ipdb::RangeSet::Union(const RangeSet &other) const {
+    RangeSet result;
+    result.v4 = uniteRanges(v4, other.v4);
+    result.v6 = uniteRanges(v6, other.v6);
+    return result;
+}
+
+ipdb::RangeSet ipdb::RangeSet::Intersect(const RangeSet &other) const {
+    RangeSet result;
+    result.v4 = intersectRanges(v4, other.v4);
+    result.v6 = intersectRanges(v6, other.v6);
+    return result;
+}
+
+ipdb::RangeSet ipdb::RangeSet::Subtract(const RangeSet &other) const {
+    RangeSet result;
+    result.v4 = subtractRanges(v4, other.v4);
+    result.v6 = subtractRanges(v6, other.v6);
+    return result;
+}
+
+vector<ipdb::Network> ipdb::RangeSet::Networks() const {
+    vector<Network> result;
+    rangeNetworks(v4, IPv4, result);
+    rangeNetworks(v6, IPv6, result);
+    return result;
+}
+
+size_t ipdb::RangeSet::Bytes() const {
+    return sizeof(*this) + v4.capacity() * sizeof(v4[0]) + v6.capacity() * sizeof(v6[0]);
+}
+
+const ipdb::RangeSet &ipdb::FieldIndex::Get(string_view value) const {
+    static const RangeSet none;
+    auto it = sets.find(value);
+    return it == sets.end() ? none : it->second;
+}
+
+vector<string> ipdb::FieldIndex::Values() const {
+    vector<string> values;
+    for (auto &set : sets) {
+        values.push_back(set.first);
+    }
+    return values;
+}
+
+size_t ipdb::FieldIndex::Bytes() const {
+    size_t bytes = sizeof(*this);
+    for (auto &set : sets) {
+        bytes += 4 * sizeof(void *) + sizeof(set) + set.first.capacity() + set.second.Bytes(); // map node
+    }
+    return bytes;
+}
+
+// Field indexes of one Reader, dropped least recently used first once their bytes pass capacity.
+// Callers asking for an index that is being built wait for that build.
+class ipdb::IndexCache {
+    struct Entry {
+        shared_future<shared_ptr<const FieldIndex>> index;
+        size_t bytes = 0; // 0 while building
+        list<pair<string, string>>::iterator use;
+    };
+    mutex lock;
+    list<pair<string, string>> lru; // language and field, most recent first
+    map<pair<string, string>, Entry> entries;
+    size_t capacity;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+public:
+    const int Threads;
+
+    IndexCache(size_t capacity, int threads) : capacity(capacity), Threads(threads) {}
+
+    template<typename F>
+    shared_ptr<const FieldIndex> Get(const string &language, const string &field, F build) {
+        auto key = make_pair(language, field);
+        promise<shared_ptr<const FieldIndex>> building;
+        shared_future<shared_ptr<const FieldIndex>> pending;
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                ++hits;
+                lru.splice(lru.begin(), lru, it->second.use);
+                pending = it->second.index;
+            } else {
+                ++misses;
+                lru.push_front(key);
+                entries[key] = Entry{building.get_future().share(), 0, lru.begin()};
+            }
+        }
+        if (pending.valid()) {
+            return pending.get();
+        }
+        shared_ptr<const FieldIndex> index;
+        try {
+            index = build();
+        } catch (...) {
+            building.set_exception(current_exception());
+            lock_guard<mutex> guard(lock);
+            auto it = entries.find(key);
+            lru.erase(it->second.use);
+            entries.erase(it);
+            throw;
+        }
+        building.set_value(index);
+        lock_guard<mutex> guard(lock);
+        auto &entry = entries[key];
+        entry.bytes = index->Bytes();
+        bytes += entry.bytes;
+        // the index just built is returned even when it alone passes capacity
+        for (auto use = lru.end(); capacity > 0 && bytes > capacity && use != lru.begin();) {
+            --use;
+            auto victim = entries.find(*use);
+            if (*use == key || victim->second.bytes == 0) {
+                continue;
+            }
+            bytes -= victim->second.bytes;
+            entries.erase(victim);
+            use = lru.erase(use);
+        }
+        return index;
+    }
+
+    CacheStats Stats() {
+        lock_guard<mutex> guard(lock);
+        return {hits, misses, bytes, capacity};
+    }
+};
+
+shared_ptr<const ipdb::FieldIndex> ipdb::Reader::buildIndex(const string &language, size_t column, int threads) const {
+    size_t workers = threads > 0 ? threads : max(1u, thread::hardware_concurrency());
+    auto index = make_shared<FieldIndex>();
+    for (auto family : {IPv4, IPv6}) {
+        if (family == IPv4 ? !IsIPv4Support() : !IsIPv6Support()) {
+            continue;
+        }
+        // subtrees in address order, each gathered into sets by value that are then joined in the same order
+        auto parts = SplitLeaves(family, language, family == IPv4 ? 8 : 16);
+        vector<unordered_map<string_view, RangeSet>> sets(parts.size());
+        parallelChunks(parts.size(), 1, workers, [&](size_t begin, size_t end) {
+            for (auto part = begin; part < end; ++part) {
+                unordered_map<const char *, RangeSet *> records; // networks of one record share its value
+                Network network;
+                RecordView record;
+                while (parts[part].Next(network, record)) {
+                    auto &set = records[record.Record().data()];
+                    if (!set) {
+                        set = &sets[part][record.Get(column)];
+                    }
+                    set->add(network);
+                }
+            }
+        });
+        for (auto &part : sets) {
+            for (auto &value : part) {
+                auto it = index->sets.find(value.first);
+                if (it == index->sets.end()) {
+                    index->sets.emplace(string(value.first), move(value.second));
+                } else {
+                    it->second.append(value.second);
+                }
+            }
+            part = {};
+        }
+    }
+    for (auto &set : index->sets) {
+        set.second.v4.shrink_to_fit();
+        set.second.v6.shrink_to_fit();
+    }
+    return index;
+}
+
+shared_ptr<const ipdb::FieldIndex> ipdb::Reader::Index(const string &language, const string &field) const {
+    if (meta.Languages.find(language) == meta.Languages.end()) {
+        throw ErrNoSupportLanguage;
+    }
+    auto column = find(meta.Fields.begin(), meta.Fields.end(), field);
+    if (column == meta.Fields.end()) {
+        throw ErrNoSupportField;
+    }
+    return indexes->Get(language, field, [&] {
+        return buildIndex(language, size_t(column - meta.Fields.begin()), indexes->Threads);
+    });
+}
+
+ipdb::Network::Network(int family, const u_char *ip, int prefixLength) : Family(family), PrefixLength(prefixLength) {
+    memcpy(Address, ip, prefixLength / 8 + (prefixLength % 8 ? 1 : 0));
+    if (prefixLength % 8) {
+        Address[prefixLength / 8] &= u_char(0xFF << uint(8 - prefixLength % 8));
+    }
+}
+
+// Character classes of an address candidate, bit i describes text[i].
+struct AddressMasks {
+    uint64_t digit = 0;
+    uint64_t hex = 0; // includes digits
+    uint64_t colon = 0;
+    uint64_t dot = 0;
+    uint64_t delimiter = 0;
+};
+
+// the longest address inet_pton accepts, "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255"
+static const size_t maxAddressLength = 45;
+
+static void classifyScalar(const char *text, size_t n, char delimiter, AddressMasks &masks) {
+    for (size_t i = 0; i < n; ++i) {
+        auto c = text[i];
+        auto bit = uint64_t(1) << i;
+        if (c >= '0' && c <= '9') {
+            masks.digit |= bit;
+            masks.hex |= bit;
+        } else if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+            masks.hex |= bit;
+        } else if (c == ':') {
+            masks.colon |= bit;
+        } else if (c == '.') {
+            masks.dot |= bit;
+        }
+        if (c == delimiter) {
+            masks.delimiter |= bit;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// reads n bytes from text rounded up to 16: up to 48 for ParseAddress, 64 for the blocks of ParseAddresses
+__attribute__((target("sse4.2"), no_sanitize("address")))
+static void classifySSE42(const char *text, size_t n, char delimiter, AddressMasks &masks) {
+    const auto hexRanges = _mm_setr_epi8('0', '9', 'a', 'f', 'A', 'F', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const auto colon = _mm_set1_epi8(':');
+    const auto dot = _mm_set1_epi8('.');
+    const auto separator = _mm_set1_epi8(delimiter);
+    for (size_t i = 0; i < n; i += 16) {
+        auto chunk = _mm_loadu_si128((const __m128i *) (text + i));
+        auto digit = _mm_cvtsi128_si32(
+                _mm_cmpestrm(hexRanges, 2, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_BIT_MASK));
+        auto hex = _mm_cvtsi128_si32(
+                _mm_cmpestrm(hexRanges, 6, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_BIT_MASK));
+        masks.digit |= uint64_t(uint16_t(digit)) << i;
+        masks.hex |= uint64_t(uint16_t(hex)) << i;
+        masks.colon |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, colon)))) << i;
+        masks.dot |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dot)))) << i;
+        masks.delimiter |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, separator)))) << i;
+    }
+}
+
+// reads n bytes from text rounded up to 32: up to 64, the most either caller passes
+__attribute__((target("avx2"), no_sanitize("address")))
+static void classifyAVX2(const char *text, size_t n, char delimiter, AddressMasks &masks) {
+    for (size_t i = 0; i < n; i += 32) {
+        auto chunk = _mm256_loadu_si256((const __m256i *) (text + i));
+        // c in [lo, hi] as signed bytes: c > lo - 1 and hi + 1 > c
+        auto digit = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, _mm256_set1_epi8('0' - 1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), chunk));
+        auto lower = _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+        auto letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+        masks.digit |= uint64_t(uint32_t(_mm256_movemask_epi8(digit))) << i;
+        masks.hex |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_or_si256(digit, letter)))) << i;
+        masks.colon |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(':'))))) << i;
+        masks.dot |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('.'))))) << i;
+        masks.delimiter |= uint64_t(uint32_t(
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(delimiter))))) << i;
+    }
+}
+
+#endif
+
+using Classifier = void (*)(const char *, size_t, char, AddressMasks &);
+
+static Classifier selectClassifier() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return classifyAVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return classifySSE42;
+    }
+#endif
+    return classifyScalar;
+}
+
+// one dotted quad in text[begin, end), the positions of its dots are in masks
+static bool parseDotted(const char *text, size_t begin, size_t end, const AddressMasks &masks, u_char *ip) {
+    auto span = end - begin;
+    if (span < 7 || span > 15) {
+        return false;
+    }
+    auto range = ((uint64_t(1) << span) - 1) << begin;
+    auto dots = masks.dot & range;
+    if (((masks.digit | dots) & range) != range) {
+        return false;
+    }
+    auto start = begin;
+    for (auto octet = 0; octet < 4; ++octet) {
+        if (octet < 3 ? dots == 0 : dots != 0) {
+            return false; // not exactly three dots
+        }
+        auto stop = octet < 3 ? size_t(__builtin_ctzll(dots)) : end;
+        dots &= dots - 1;
+        auto length = stop - start;
+        if (length == 0 || length > 3 || (length > 1 && text[start] == '0')) {
+            return false;
+        }
+        auto value = 0;
+        for (auto i = start; i < stop; ++i) {
+            value = value * 10 + (text[i] - '0');
+        }
+        if (value > 255) {
+            return false;
+        }
+        ip[octet] = u_char(value);
+        start = stop + 1;
+    }
+    return true;
+}
+
+// The same rules for a whole token without data-dependent branches: octets are located by the dots in masks
+// and decoded from their first three bytes, clamped to the token; the weights drop the bytes a short octet
+// does not have.
+static bool parseQuad(const char *text, size_t n, uint64_t digits, uint64_t dots, u_char *ip) {
+    if (n < 7 || n > 15) {
+        return false;
+    }
+    auto all = (uint64_t(1) << n) - 1;
+    digits &= all;
+    dots &= all;
+    auto third = dots & (dots - 1);
+    third &= third - 1;
+    if ((digits | dots) != all || third == 0 || (third & (third - 1)) != 0) {
+        return false; // not digits and exactly three dots
+    }
+    // weights of the first three digits by octet length, 0 for the invalid lengths 0 and 4+
+    static const int weights[4][3] = {{0, 0, 0}, {1, 0, 0}, {10, 1, 0}, {100, 10, 1}};
+    auto bad = 0;
+    size_t start = 0;
+    for (auto octet = 0; octet < 4; ++octet) {
+        auto stop = octet < 3 ? size_t(__builtin_ctzll(dots)) : n;
+        dots &= dots - 1;
+        auto length = stop - start;
+        auto &w = weights[length & 3];
+        int d0 = text[min(start, n - 1)] - '0', d1 = text[min(start + 1, n - 1)] - '0', d2 = text[min(start + 2, n - 1)] - '0';
+        auto value = d0 * w[0] + d1 * w[1] + d2 * w[2];
+        bad |= (length - 1 > 2) | ((length > 1) & (d0 == 0)) | (value > 255);
+        ip[octet] = u_char(value);
+        start = stop + 1;
+    }
+    return !bad;
+}
+
+static int hexValue(char c) {
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+// follows glibc's inet_pton6 group by group, jumping between the colons in masks
+static bool parseColon(const char *text, size_t n, const AddressMasks &masks, u_char *ip) {
+    uint16_t groups[8];
+    auto count = 0;
+    auto gap = -1;
+    size_t i = 0;
+    if (text[0] == ':') {
+        if (n < 2 || text[1] != ':') {
+            return false;
+        }
+        i = 1;
+    }
+    while (i < n) {
+        if (text[i] == ':') {
+            if (gap >= 0) {
+                return false;
+            }
+            gap = count;
+            ++i;
+            continue;
+        }
+        auto after = masks.colon >> i;
+        auto j = after ? i + __builtin_ctzll(after) : n;
+        auto span = ((uint64_t(1) << (j - i)) - 1) << i;
+        if (masks.dot & span) {
+            u_char quad[4];
+            if (j != n || count > 6 || !parseDotted(text, i, n, masks, quad)) {
+                return false;
+            }
+            groups[count++] = uint16_t(quad[0] << 8 | quad[1]);
+            groups[count++] = uint16_t(quad[2] << 8 | quad[3]);
+            break;
+        }
+        if (j - i > 4 || (masks.hex & span) != span || count == 8) {
+            return false;
+        }
+        auto value = 0;
+        for (auto k = i; k < j; ++k) {
+            value = (value << 4) | hexValue(text[k]);
+        }
+        groups[count++] = uint16_t(value);
+        if (j == n) {
+            break;
+        }
+        if (j + 1 == n) {
+            return false;
+        }
+        i = j + 1;
+    }
+    if (gap >= 0 ? count == 8 : count != 8) {
+        return false;
+    }
+    // the groups after the gap move to the end, the gap becomes zeros
+    auto zeros = 8 - count;
+    for (auto k = 0; k < 8; ++k) {
+        uint16_t value = 0;
+        if (gap < 0 || k < gap) {
+            value = groups[k];
+        } else if (k >= gap + zeros) {
+            value = groups[k - zeros];
+        }
+        ip[2 * k] = u_char(value >> 8);
+        ip[2 * k + 1] = u_char(value);
+    }
+    return true;
+}
+
+// text[0, n) with its classes in masks, bits past n may be set
+static int parseClassified(const char *text, size_t n, AddressMasks masks, ipdb::Address &address) {
+    address.Family = 0;
+    if (n == 0 || n > maxAddressLength) {
+        return 0;
+    }
+    auto all = (uint64_t(1) << n) - 1;
+    masks.digit &= all;
+    masks.hex &= all;
+    masks.colon &= all;
+    masks.dot &= all;
+    if ((masks.hex | masks.colon | masks.dot) != all) {
+        return 0;
+    }
+    if (masks.colon) {
+        if (parseColon(text, n, masks, address.Bytes)) {
+            address.Family = IPv6;
+        }
+    } else if (parseQuad(text, n, masks.digit, masks.dot, address.Bytes)) {
+        address.Family = IPv4;
+    }
+    return address.Family;
+}
+
+int ipdb::ParseAddress(string_view text, Address &address) {
+    static const Classifier classify = selectClassifier();
+    auto n = text.size();
+    if (n == 0 || n > maxAddressLength) {
+        address.Family = 0;
+        return 0;
+    }
+    // the vector classifiers load 64 bytes from text; past its end that is harmless while the loads stay in
+    // the same page, otherwise they read a padded copy
+    auto p = text.data();
+    char padded[64];
+    if ((reinterpret_cast<uintptr_t>(p) & 4095) > 4096 - 64) {
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, p, n);
+        p = padded;
+    }
+    AddressMasks masks;
+    classify(p, n, 0, masks);
+    return parseClassified(p, n, masks, address);
+}
+
+// masks of buffer[offset, offset + 64) out of per-block masks
+static uint64_t maskAt(const uint64_t AddressMasks::*member, const AddressMasks *blocks, size_t offset) {
+    auto shift = offset % 64;
+    auto low = blocks[offset / 64].*member;
+    return shift ? low >> shift | (blocks[offset / 64 + 1].*member) << (64 - shift) : low;
+}
+
+size_t ipdb::ParseAddresses(string_view buffer, char delimiter, vector<Address> &out) {
+    static const Classifier classify = selectClassifier();
+    // the buffer is classified one window at a time, 64 bytes per block; every token starting in a window
+    // also has the following block classified, which covers any token short enough to be an address
+    const size_t window = 4096;
+    AddressMasks blocks[window / 64 + 2];
+    auto size = buffer.size();
+    size_t count = 0;
+    size_t start = 0;
+    while (start < size) {
+        auto base = start;
+        auto length = std::min(size - base, window + 64);
+        for (size_t block = 0; block * 64 < window + 64; ++block) {
+            auto offset = block * 64;
+            blocks[block] = AddressMasks();
+            if (offset >= length) {
+                continue;
+            }
+            auto p = buffer.data() + base + offset;
+            char padded[64];
+            if (length - offset < 64) {
+                memset(padded, 0, sizeof(padded));
+                memcpy(padded, p, length - offset);
+                p = padded;
+            }
+            classify(p, 64, delimiter, blocks[block]);
+        }
+        blocks[window / 64 + 1] = AddressMasks();
+        while (start < size && start - base < window) {
+            auto offset = start - base;
+            auto delimiters = maskAt(&AddressMasks::delimiter, blocks, offset);
+            size_t end;
+            if (delimiters) {
+                end = std::min(start + __builtin_ctzll(delimiters), size); // a NUL delimiter also matches padding
+            } else if (base + length == size && size - start < 64) {
+                end = size;
+            } else {
+                end = buffer.find(delimiter, start); // longer than any address
+                end = end == string_view::npos ? size : end;
+            }
+            auto n = end - start;
+            out.emplace_back();
+            ++count;
+            auto colons = n <= maxAddressLength ? maskAt(&AddressMasks::colon, blocks, offset) : 0;
+            if (n <= maxAddressLength && !(colons & ((uint64_t(1) << n) - 1))) {
+                // no colon: IPv4 or nothing, decoded straight from the masks
+                if (parseQuad(buffer.data() + start, n, maskAt(&AddressMasks::digit, blocks, offset),
+                              maskAt(&AddressMasks::dot, blocks, offset), out.back().Bytes)) {
+                    out.back().Family = IPv4;
+                }
+                start = end + 1;
+                continue;
+            }
+            AddressMasks masks;
+            if (n <= maxAddressLength) {
+                masks.digit = maskAt(&AddressMasks::digit, blocks, offset);
+                masks.hex = maskAt(&AddressMasks::hex, blocks, offset);
+                masks.colon = colons;
+                masks.dot = maskAt(&AddressMasks::dot, blocks, offset);
+            }
+            parseClassified(buffer.data() + start, n, masks, out.back());
+            start = end + 1;
+        }
+    }
+    return count;
+}
+
+ipdb::Network ipdb::Network::Parse(const string &cidr) {
+    auto slash = cidr.find('/');
+    ipdb::Address addr; // not the Address member
+    auto family = ParseAddress(string_view(cidr).substr(0, slash), addr);
+    if (family == 0) {
+        throw ErrIPFormat;
+    }
+    auto bitCount = family == IPv4 ? 32 : 128;
+    auto prefixLength = bitCount;
+    if (slash != string::npos) {
+        auto length = cidr.substr(slash + 1);
+        if (length.empty() || length.size() > 3 || length.find_first_not_of("0123456789") != string::npos) {
+            throw ErrIPFormat;
+        }
+        prefixLength = stoi(length);
+        if (prefixLength > bitCount) {
+            throw ErrIPFormat;
+        }
+    }
+    return Network(family, addr.Bytes, prefixLength);
+}
+
+bool ipdb::Network::Contains(const in_addr &addr) const {
+    return Family == IPv4 && prefixMatch(Address, (const u_char *) &addr.s_addr, PrefixLength);
+}
+
+bool ipdb::Network::Contains(const in6_addr &addr) const {
+    return Family == IPv6 && prefixMatch(Address, (const u_char *) &addr.s6_addr, PrefixLength);
+}
+
+string ipdb::Network::str() const {
+    char buf[INET6_ADDRSTRLEN];
+    inet_ntop(Family == IPv4 ? AF_INET : AF_INET6, Address, buf, sizeof(buf));
+    return string(buf) + "/" + to_string(PrefixLength);
+}
+
+map<string, string> ipdb::Reader::FindMap(const string &addr, const string &language) const {
+    return view1(addr, language).ToMap();
+}
+
+map<string, string> ipdb::Reader::FindMap(const in_addr &addr, const string &language) const {
+    return view1(addr, language).ToMap();
+}
+
+map<string, string> ipdb::Reader::FindMap(const in6_addr &addr, const string &language) const {
+    return view1(addr, language).ToMap();
+}
+
+map<string, string> ipdb::Reader::FindMap(uint32_t addr, const string &language) const {
+    return view1(addr, language).ToMap();
+}
+
+map<string, string> ipdb::Reader::FindMap(const sockaddr_storage &addr, const string &language) const {
+    return view1(addr, language).ToMap();
+}
+
+vector<string> ipdb::Reader::Find(const string &addr, const string &language) const {
+    return find1(addr, language);
+}
+
+vector<string> ipdb::Reader::Find(const in_addr &addr, const string &language) const {
+    return find1(addr, language);
+}
+
+vector<string> ipdb::Reader::Find(const in6_addr &addr, const string &language) const {
+    return find1(addr, language);
+}
+
+vector<string> ipdb::Reader::Find(uint32_t addr, const string &language) const {
+    return find1(addr, language);
+}
+
+vector<string> ipdb::Reader::Find(const sockaddr_storage &addr, const string &language) const {
+    return find1(addr, language);
+}
+
+bool ipdb::Reader::IsIPv6Support() const {
+    return (meta.IPVersion & IPv6) == IPv6;
+}
+
+bool ipdb::Reader::IsIPv4Support() const {
+    return (meta.IPVersion & IPv4) == IPv4;
+}
+
+void ipdb::Reader::load(const u_char *buf, size_t size) {
+    if (size < 4) {
+        throw ErrFileSize;
+    }
+    uint32_t metaLength = 0ul;
+    memcpy(&metaLength, buf, 4);
+    metaLength = ntohl(metaLength);
+    if (size < 4 + (size_t) metaLength) {
+        throw ErrFileSize;
+    }
+    meta.Parse(string((const char *) buf + 4, metaLength));
+    if (meta.Languages.empty() || meta.Fields.empty()) {
+        throw ErrMetaData;
+    }
+    if (size != (4 + metaLength + meta.TotalSize)) {
+        throw ErrFileSize;
+    }
+    fileSize = (int) size;
+    data = buf + 4 + metaLength;
+    dataSize = (int) size - 4 - metaLength;
+    // the size check trusts total_size; a caller's buffer may still hold fewer nodes than node_count claims.
+    // Walks that reach the empty marker read node NodeCount too, so its 8 bytes must be there.
+    if (meta.NodeCount < 0 || (size_t) meta.NodeCount * 8 + 8 > (size_t) dataSize) {
+        throw ErrDatabaseError;
+    }
+    auto node = 0;
+    for (auto i = 0; i < 96 && node < meta.NodeCount; ++i) {
+        if (i >= 80) {
+            node = readNode(node, 1);
+        } else {
+            node = readNode(node, 0);
+        }
+    }
+    v4offset = node;
+}
+
+void ipdb::Reader::buildV4Table(int node, int depth, uint32_t prefix) {
+    if (depth == v4TableBits || node > meta.NodeCount) {
+        auto shift = uint(v4TableBits - depth);
+        fill(v4table.begin() + (prefix << shift), v4table.begin() + ((prefix + 1) << shift), node);
+        fill(v4depth.begin() + (prefix << shift), v4depth.begin() + ((prefix + 1) << shift), u_char(depth));
+        return;
+    }
+    buildV4Table(readNode(node, 0), depth + 1, prefix << 1);
+    buildV4Table(readNode(node, 1), depth + 1, (prefix << 1) | 1);
+}
+
+// Anonymous memory for a copy of size bytes, 2 MB aligned and advised or allocated as huge pages.
+static shared_ptr<void> hugeImage(size_t size, ipdb::HugePages hugePages) {
+    auto length = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+    if (hugePages == ipdb::HugePages::Explicit) {
+        auto addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED) {
+            throw ErrHugePages;
+        }
+        return shared_ptr<void>(addr, [length](void *p) { munmap(p, length); });
+    }
+    // over-allocate to align, THP only backs whole aligned 2 MB ranges
+    auto addr = mmap(nullptr, length + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        throw ErrFileSize;
+    }
+    auto aligned = (void *) ((uintptr_t(addr) + hugePageSize - 1) & ~(hugePageSize - 1));
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return shared_ptr<void>(aligned, [addr, length](void *) { munmap(addr, length + hugePageSize); });
+}
+
+// a pread loop into buf, false on a short or failed read
+static bool readAll(int fd, u_char *buf, size_t size) {
+    for (size_t done = 0; done < size;) {
+        auto n = pread(fd, buf + done, size - done, off_t(done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += size_t(n);
+    }
+    return true;
+}
+
+void ipdb::Reader::open(int fd, const ReaderOptions &options) {
+    if (options.mmap && options.hugePages == HugePages::Explicit) {
+        throw ErrReaderOptions;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) == -1) {
+        throw ErrFileSize;
+    }
+    auto size = (size_t) st.st_size;
+    if (options.mmap) {
+        if (!S_ISREG(st.st_mode) || size == 0) {
+            throw ErrFileSize;
+        }
+        auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED | (options.prefault ? MAP_POPULATE : 0), fd, 0);
+        if (addr == MAP_FAILED) {
+            throw ErrFileSize;
+        }
+        if (options.hugePages == HugePages::Transparent) {
+            madvise(addr, size, MADV_HUGEPAGE); // best effort, needs file THP support
+        }
+        image = shared_ptr<void>(addr, [size](void *p) { munmap(p, size); });
+        load((const u_char *) addr, size);
+        if (options.randomAccess) {
+            // whole pages inside the node array, faults there then read only the page they hit
+            auto first = (uintptr_t(data) + 4095) & ~uintptr_t(4095);
+            auto last = (uintptr_t(data) + size_t(meta.NodeCount) * 8) & ~uintptr_t(4095);
+            if (last > first) {
+                madvise((void *) first, last - first, MADV_RANDOM);
+            }
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        if (options.hugePages != HugePages::None) {
+            image = hugeImage(size, options.hugePages);
+        } else {
+            image = shared_ptr<u_char>(new u_char[size], std::default_delete<u_char[]>());
+        }
+        if (!readAll(fd, (u_char *) image.get(), size)) {
+            throw ErrFileSize;
+        }
+        load((const u_char *) image.get(), size);
+    } else {
+        // a pipe or socket: read to the end, the size is only known then
+        auto buf = make_shared<vector<u_char>>(1 << 20);
+        size_t used = 0;
+        for (;;) {
+            if (used == buf->size()) {
+                buf->resize(used * 2);
+            }
+            auto n = read(fd, buf->data() + used, buf->size() - used);
+            if (n == 0) {
+                break;
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw ErrFileSize;
+            }
+            used += size_t(n);
+        }
+        buf->resize(used);
+        size = buf->size();
+        if (options.hugePages != HugePages::None) {
+            image = hugeImage(size, options.hugePages);
+            memcpy(image.get(), buf->data(), size);
+        } else {
+            image = shared_ptr<void>(buf, buf->data());
+        }
+        load((const u_char *) image.get(), size);
+    }
+    memory.Mapped = options.mmap;
+}
+
+void ipdb::Reader::setup(const ReaderOptions &options) {
+    memory.Bytes = size_t(fileSize);
+    if (options.mlock) {
+        if (::mlock(image.get(), memory.Bytes) != 0) {
+            throw ErrMemoryLock;
+        }
+        // unlocked with the last reference to the image
+        image = shared_ptr<void>(image.get(), [held = image, size = memory.Bytes](void *p) { munlock(p, size); });
+        memory.Locked = true;
+    }
+    if (options.v4TableBits > 0 && IsIPv4Support()) {
+        v4TableBits = options.v4TableBits;
+        v4table.resize(size_t(1) << uint(v4TableBits));
+        v4depth.resize(v4table.size());
+        buildV4Table(v4offset, 0, 0);
+    }
+    if (options.cacheSize > 0) {
+        cache = make_shared<RecordCache>(options.cacheSize);
+    }
+#ifdef IPDB_METRICS
+    meter = make_shared<Meter>();
+#endif
+    if (options.engine == TrieEngine::Poptrie) {
+        if (IsIPv4Support()) {
+            v4trie = buildTrie(v4offset, 32);
+        }
+        if (IsIPv6Support()) {
+            v6trie = buildTrie(0, 128);
+        }
+    }
+    indexes = make_shared<IndexCache>(options.indexBytes, options.indexThreads);
+    rangeCacheSize = options.rangeCacheSize;
+    if (rangeCacheSize > 0) {
+        rangeCacheKey = make_shared<char>();
+    }
+    if (!options.tableLanguages.empty()) {
+        buildTables(options.tableLanguages, options.tableThreads);
+    }
+}
+
+static void checkOptions(const ipdb::ReaderOptions &options) {
+    if (options.v4TableBits < 0 || options.v4TableBits > 24) {
+        throw ErrReaderOptions;
+    }
+}
+
+ipdb::Reader::Reader(const string &file, const ReaderOptions &options) {
+    checkOptions(options);
+    auto fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw ErrFileSize;
+    }
+    try {
+        open(fd, options);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    setup(options);
+}
+
+ipdb::Reader::Reader(int fd, const ReaderOptions &options) {
+    checkOptions(options);
+    open(fd, options);
+    setup(options);
+}
+
+ipdb::Reader::Reader(const void *buffer, size_t size, const ReaderOptions &options)
+        : Reader(shared_ptr<const void>(buffer, [](const void *) {}), size, options) {}
+
+ipdb::Reader::Reader(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options) {
+    checkOptions(options);
+    if (options.mmap || options.hugePages != HugePages::None) {
+        throw ErrReaderOptions; // both would need a copy of the buffer
+    }
+    if (!buffer) {
+        throw ErrFileSize;
+    }
+    image = const_pointer_cast<void>(move(buffer));
+    load((const u_char *) image.get(), size);
+    setup(options);
+}
+
+ipdb::Reader::~Reader() = default;
+
+uint64_t ipdb::Reader::BuildTime() const {
+    return meta.Build;
+}
+
+size_t ipdb::Reader::TrieBytes() const {
+    return (v4trie ? v4trie->Bytes() : 0) + (v6trie ? v6trie->Bytes() : 0);
+}
+
+size_t ipdb::Reader::V4TableBytes() const {
+    return v4table.size() * sizeof(int) + v4depth.size();
+}
+
+ipdb::CacheStats ipdb::Reader::RecordCacheStats() const {
+    if (!cache) {
+        return {};
+    }
+    return cache->Stats();
+}
+
+ipdb::CacheStats ipdb::Reader::IndexStats() const {
+    return indexes->Stats();
+}
+
+ipdb::CacheStats ipdb::Reader::RangeCacheStats() const {
+    if (rangeCacheSize == 0) {
+        return {};
+    }
+    return rangeCache().Stats();
+}
+
+vector<string> ipdb::Reader::Languages() const {
+    vector<string> ls;
+    for (const auto &i:meta.Languages) {
+        ls.emplace_back(i.first);
+    }
+    return ls;
+}
+
+vector<string> ipdb::Reader::Fields() const {
+    return meta.Fields;
+}
+
+template<typename Info>
+static ipdb::Schema<Info> makeSchema(const vector<string> &fields) {
+    ipdb::Schema<Info> schema;
+    for (auto &field : fields) {
+        schema.push_back(Info::Field(field));
+    }
+    return schema;
+}
+
+// copies the string members of a JSON object into the Info fields of the same name
+template<typename Info>
+static void decodeJSON(const rapidjson::Value &object, Info &info) {
+    for (const auto &o : object.GetObject()) {
+        auto field = Info::Field(string_view(o.name.GetString(), o.name.GetStringLength()));
+        if (field && o.value.IsString()) {
+            info.*field = string(o.value.GetString(), o.value.GetStringLength());
+        }
+    }
+}
+
+ipdb::ASNInfo::ASNInfo(const vector<string> &data, const vector<string> &fields) {
+    for (size_t i = 0; i < fields.size() && i < data.size(); ++i) {
+        auto field = Field(fields[i]);
+        if (field) {
+            this->*field = data[i];
+        }
+    }
+}
+
+string ipdb::ASNInfo::*ipdb::ASNInfo::Field(string_view name) {
+    static const pair<string_view, string ASNInfo::*> fields[] = {
+            {"asn", &ASNInfo::asn},
+            {"reg", &ASNInfo::reg},
+            {"cc", &ASNInfo::cc},
+            {"net", &ASNInfo::net},
+            {"org", &ASNInfo::org},
+            {"type", &ASNInfo::type},
+            {"domain", &ASNInfo::domain},
+    };
+    for (auto &field : fields) {
+        if (field.first == name) {
+            return field.second;
+        }
+    }
+    return nullptr;
+}
+
+string ipdb::ASNInfo::GetAsn() const { return asn; }
+
+string ipdb::ASNInfo::GetReg() const { return reg; }
+
+string ipdb::ASNInfo::GetCc() const { return cc; }
+
+string ipdb::ASNInfo::GetNet() const { return net; }
+
+string ipdb::ASNInfo::GetOrg() const { return org; }
+
+string ipdb::ASNInfo::GetType() const { return type; }
+
+string ipdb::ASNInfo::GetDomain() const { return domain; }
+
+string ipdb::ASNInfo::str() const {
+    stringstream sb;
+    sb << "asn: " << asn << endl;
+    sb << "reg: " << reg << endl;
+    sb << "cc: " << cc << endl;
+    sb << "net: " << net << endl;
+    sb << "org: " << org << endl;
+    sb << "type: " << type << endl;
+    sb << "domain: " << domain << endl;
+    return sb.str();
+}
+
+ipdb::CityInfo::CityInfo(const vector<string> &data, const vector<string> &fields) {
+    for (size_t i = 0; i < fields.size() && i < data.size(); ++i) {
+        auto field = Field(fields[i]);
+        if (field) {
+            this->*field = data[i];
+            hasDistrictInfo |= field == &CityInfo::district_info;
+        }
+    }
+}
+
+ipdb::CityInfo::CityInfo(const RecordView &view, const Schema<CityInfo> &schema) {
+    auto body = view.Record();
+    string_view::size_type begin = 0;
+    for (size_t i = 0; i < schema.size() && i < view.Size(); ++i) {
+        auto end = body.find('\t', begin);
+        if (schema[i]) {
+            this->*schema[i] = string(body.substr(begin, end == string_view::npos ? string_view::npos : end - begin));
+            hasDistrictInfo |= schema[i] == &CityInfo::district_info;
+        }
+        begin = end + 1;
+    }
+}
+
+string ipdb::CityInfo::*ipdb::CityInfo::Field(string_view name) {
+    static const pair<string_view, string CityInfo::*> fields[] = {
+            {"country_name", &CityInfo::country_name},
+            {"region_name", &CityInfo::region_name},
+            {"city_name", &CityInfo::city_name},
+            {"district_name", &CityInfo::district_name},
+            {"owner_domain", &CityInfo::owner_domain},
+            {"isp_domain", &CityInfo::isp_domain},
+            {"latitude", &CityInfo::latitude},
+            {"longitude", &CityInfo::longitude},
+            {"timezone", &CityInfo::timezone},
+            {"utc_offset", &CityInfo::utc_offset},
+            {"china_admin_code", &CityInfo::china_admin_code},
+            {"idd_code", &CityInfo::idd_code},
+            {"country_code", &CityInfo::country_code},
+            {"continent_code", &CityInfo::continent_code},
+            {"idc", &CityInfo::idc},
+            {"base_station", &CityInfo::base_station},
+            {"country_code3", &CityInfo::country_code3},
+            {"european_union", &CityInfo::european_union},
+            {"currency_code", &CityInfo::currency_code},
+            {"currency_name", &CityInfo::currency_name},
+            {"anycast", &CityInfo::anycast},
+            {"line", &CityInfo::line},
+            {"district_info", &CityInfo::district_info},
+            {"route", &CityInfo::route},
+            {"asn", &CityInfo::asn},
+            {"asn_info", &CityInfo::asn_info},
+            {"area_code", &CityInfo::area_code},
+            {"usage_type", &CityInfo::usage_type},
+    };
+    for (auto &field : fields) {
+        if (field.first == name) {
+            return field.second;
+        }
+    }
+    return nullptr;
+}
+
+string ipdb::CityInfo::GetCountryName() const { return country_name; }
+
+string ipdb::CityInfo::GetRegionName() const { return region_name; }
+
+string ipdb::CityInfo::GetCityName() const { return city_name; }
+
+string ipdb::CityInfo::GetDistrictName() const { return district_name; }
+
+string ipdb::CityInfo::GetOwnerDomain() const { return owner_domain; }
+
+string ipdb::CityInfo::GetIspDomain() const { return isp_domain; }
+
+string ipdb::CityInfo::GetLatitude() const { return latitude; }
+
+string ipdb::CityInfo::GetLongitude() const { return longitude; }
+
+string ipdb::CityInfo::GetTimezone() const { return timezone; }
+
+string ipdb::CityInfo::GetUtcOffset() const { return utc_offset; }
+
+string ipdb::CityInfo::GetChinaAdminCode() const { return china_admin_code; }
+
+string ipdb::CityInfo::GetIddCode() const { return idd_code; }
+
+string ipdb::CityInfo::GetCountryCode() const { return country_code; }
+
+string ipdb::CityInfo::GetContinentCode() const { return continent_code; }
+
+string ipdb::CityInfo::GetIDC() const { return idc; }
+
+string ipdb::CityInfo::GetBaseStation() const { return base_station; }
+
+string ipdb::CityInfo::GetCountryCode3() const { return country_code3; }
+
+string ipdb::CityInfo::GetEuropeanUnion() const { return european_union; }
+
+string ipdb::CityInfo::GetCurrencyCode() const { return currency_code; }
+
+string ipdb::CityInfo::GetCurrencyName() const { return currency_name; }
+
+string ipdb::CityInfo::GetAnycast() const { return anycast; }
+
+string ipdb::CityInfo::GetLine() const { return line; }
+
+shared_ptr<ipdb::DistrictInfo> ipdb::CityInfo::GetDistrictInfo() const {
+    if (!hasDistrictInfo) {
+        return nullptr;
+    }
+    return decodedDistrictInfo.Get([this] {
+        DistrictInfo info;
+        if (!district_info.empty()) {
+            Document doc;
+            doc.Parse(district_info.c_str());
+            if (doc.IsObject()) {
+                decodeJSON(doc, info);
+            }
+        }
+        return info;
+    });
+}
+
+string ipdb::CityInfo::GetRoute() const { return route; }
+
+string ipdb::CityInfo::GetASN() const { return asn; }
+
+vector<shared_ptr<ipdb::ASNInfo>> ipdb::CityInfo::GetASNInfo() const {
+    return *decodedASNInfo.Get([this] {
+        vector<shared_ptr<ASNInfo>> infos;
+        if (!asn_info.empty()) {
+            Document doc;
+            doc.Parse(asn_info.c_str());
+            if (doc.IsArray()) {
+                for (const auto &o : doc.GetArray()) {
+                    if (o.IsObject()) {
+                        auto info = make_shared<ASNInfo>();
+                        decodeJSON(o, *info);
+                        infos.push_back(info);
+                    }
+                }
+            }
+        }
+        return infos;
+    });
+}
+
+string ipdb::CityInfo::GetAreaCode() const { return area_code; }
+
+string ipdb::CityInfo::GetUsageType() const { return usage_type; }
+
+string ipdb::CityInfo::str() const {
+    stringstream sb;
+    sb << "country_name: " << country_name << endl;
+    sb << "region_name: " << region_name << endl;
+    sb << "city_name: " << city_name << endl;
+    sb << "district_name: " << district_name << endl;
+    sb << "owner_domain: " << owner_domain << endl;
+    sb << "isp_domain: " << isp_domain << endl;
+    sb << "latitude: " << latitude << endl;
+    sb << "longitude: " << longitude << endl;
+    sb << "timezone: " << timezone << endl;
+    sb << "utc_offset: " << utc_offset << endl;
+    sb << "china_admin_code: " << china_admin_code << endl;
+    sb << "idd_code: " << idd_code << endl;
+    sb << "country_code: " << country_code << endl;
+    sb << "continent_code: " << continent_code << endl;
+    sb << "idc: " << idc << endl;
+    sb << "base_station: " << base_station << endl;
+    sb << "country_code3: " << country_code3 << endl;
+    sb << "european_union: " << european_union << endl;
+    sb << "currency_code: " << currency_code << endl;
+    sb << "currency_name: " << currency_name << endl;
+    sb << "anycast: " << anycast << endl;
+    sb << "line: " << line << endl;
+    if (hasDistrictInfo) sb << "district_info: " << GetDistrictInfo()->str() << endl;
+    sb << "route: " << route << endl;
+    sb << "asn: " << asn << endl;
+    for (const auto &i:GetASNInfo())
+        sb << "asn_info: " << i->str() << endl;
+    sb << "area_code: " << area_code << endl;
+    sb << "usage_type: " << usage_type << endl;
+    return sb.str();
+}
+
+ipdb::City::City(const string &file, const ReaderOptions &options)
+        : Reader(file, options), schema(makeSchema<CityInfo>(Fields())) {}
+
+ipdb::City::City(int fd, const ReaderOptions &options)
+        : Reader(fd, options), schema(makeSchema<CityInfo>(Fields())) {}
+
+ipdb::City::City(const void *buffer, size_t size, const ReaderOptions &options)
+        : Reader(buffer, size, options), schema(makeSchema<CityInfo>(Fields())) {}
+
+ipdb::City::City(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options)
+        : Reader(move(buffer), size, options), schema(makeSchema<CityInfo>(Fields())) {}
+
+ipdb::CityInfo ipdb::City::FindInfo(const string &addr, const string &language) const {
+    return info1<CityInfo>(addr, language, schema);
+}
+
+ipdb::CityInfo ipdb::City::FindInfo(const in_addr &addr, const string &language) const {
+    return info1<CityInfo>(addr, language, schema);
+}
+
+ipdb::CityInfo ipdb::City::FindInfo(const in6_addr &addr, const string &language) const {
+    return info1<CityInfo>(addr, language, schema);
+}
+
+ipdb::CityInfo ipdb::City::FindInfo(uint32_t addr, const string &language) const {
+    return info1<CityInfo>(addr, language, schema);
+}
+
+ipdb::CityInfo ipdb::City::FindInfo(const sockaddr_storage &addr, const string &language) const {
+    return info1<CityInfo>(addr, language, schema);
+}
+
+shared_ptr<const ipdb::CityInfo> ipdb::City::FindSharedInfo(const string &addr, const string &language) const {
+    return findInfo<CityInfo>(addr, language, schema);
+}
+
+shared_ptr<const ipdb::CityInfo> ipdb::City::FindSharedInfo(const in_addr &addr, const string &language) const {
+    return findInfo<CityInfo>(addr, language, schema);
+}
+
+shared_ptr<const ipdb::CityInfo> ipdb::City::FindSharedInfo(const in6_addr &addr, const string &language) const {
+    return findInfo<CityInfo>(addr, language, schema);
+}
+
+shared_ptr<const ipdb::CityInfo> ipdb::City::FindSharedInfo(uint32_t addr, const string &language) const {
+    return findInfo<CityInfo>(addr, language, schema);
+}
+
+shared_ptr<const ipdb::CityInfo> ipdb::City::FindSharedInfo(const sockaddr_storage &addr, const string &language) const {
+    return findInfo<CityInfo>(addr, language, schema);
+}
+
+ipdb::Status ipdb::City::TryFindInfo(const string &addr, const string &language, CityInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::Status ipdb::City::TryFindInfo(const in_addr &addr, const string &language, CityInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::Status ipdb::City::TryFindInfo(const in6_addr &addr, const string &language, CityInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::Status ipdb::City::TryFindInfo(uint32_t addr, const string &language, CityInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::Status ipdb::City::TryFindInfo(const sockaddr_storage &addr, const string &language, CityInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::BaseStationInfo::BaseStationInfo(const vector<string> &data, const vector<string> &fields) {
+    for (size_t i = 0; i < fields.size() && i < data.size(); ++i) {
+        auto field = Field(fields[i]);
+        if (field) {
+            this->*field = data[i];
+        }
+    }
+}
+
+ipdb::BaseStationInfo::BaseStationInfo(const RecordView &view, const Schema<BaseStationInfo> &schema) {
+    auto body = view.Record();
+    string_view::size_type begin = 0;
+    for (size_t i = 0; i < schema.size() && i < view.Size(); ++i) {
+        auto end = body.find('\t', begin);
+        if (schema[i]) {
+            this->*schema[i] = string(body.substr(begin, end == string_view::npos ? string_view::npos : end - begin));
+        }
+        begin = end + 1;
+    }
+}
+
+string ipdb::BaseStationInfo::*ipdb::BaseStationInfo::Field(string_view name) {
+    static const pair<string_view, string BaseStationInfo::*> fields[] = {
+            {"country_name", &BaseStationInfo::country_name},
+            {"region_name", &BaseStationInfo::region_name},
+            {"city_name", &BaseStationInfo::city_name},
+            {"owner_domain", &BaseStationInfo::owner_domain},
+            {"isp_domain", &BaseStationInfo::isp_domain},
+            {"base_station", &BaseStationInfo::base_station},
+    };
+    for (auto &field : fields) {
+        if (field.first == name) {
+            return field.second;
+        }
+    }
+    return nullptr;
+}
+
+string ipdb::BaseStationInfo::GetCountryName() const { return country_name; }
+
+string ipdb::BaseStationInfo::GetRegionName() const { return region_name; }
+
+string ipdb::BaseStationInfo::GetCityName() const { return city_name; }
+
+string ipdb::BaseStationInfo::GetOwnerDomain() const { return owner_domain; }
+
+string ipdb::BaseStationInfo::GetIspDomain() const { return isp_domain; }
+
+string ipdb::BaseStationInfo::GetBaseStation() const { return base_station; }
+
+string ipdb::BaseStationInfo::str() const {
+    stringstream sb;
+    sb << "country_name: " << country_name << endl;
+    sb << "region_name: " << region_name << endl;
+    sb << "city_name: " << city_name << endl;
+    sb << "owner_domain: " << owner_domain << endl;
+    sb << "isp_domain: " << isp_domain << endl;
+    sb << "base_station: " << base_station << endl;
+    return sb.str();
+}
+
+ipdb::BaseStation::BaseStation(const string &file, const ReaderOptions &options)
+        : Reader(file, options), schema(makeSchema<BaseStationInfo>(Fields())) {}
+
+ipdb::BaseStation::BaseStation(int fd, const ReaderOptions &options)
+        : Reader(fd, options), schema(makeSchema<BaseStationInfo>(Fields())) {}
+
+ipdb::BaseStation::BaseStation(const void *buffer, size_t size, const ReaderOptions &options)
+        : Reader(buffer, size, options), schema(makeSchema<BaseStationInfo>(Fields())) {}
+
+ipdb::BaseStation::BaseStation(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options)
+        : Reader(move(buffer), size, options), schema(makeSchema<BaseStationInfo>(Fields())) {}
+
+ipdb::BaseStationInfo ipdb::BaseStation::FindInfo(const string &addr, const string &language) const {
+    return info1<BaseStationInfo>(addr, language, schema);
+}
+
+ipdb::BaseStationInfo ipdb::BaseStation::FindInfo(const in_addr &addr, const string &language) const {
+    return info1<BaseStationInfo>(addr, language, schema);
+}
+
+ipdb::BaseStationInfo ipdb::BaseStation::FindInfo(const in6_addr &addr, const string &language) const {
+    return info1<BaseStationInfo>(addr, language, schema);
+}
+
+ipdb::BaseStationInfo ipdb::BaseStation::FindInfo(uint32_t addr, const string &language) const {
+    return info1<BaseStationInfo>(addr, language, schema);
 }
 
-vector<string> split(const string &s, const string &sp) {
-    vector<string> output;
-    string::size_type prev_pos = 0, pos = 0;
-    while ((pos = s.find(sp, pos)) != string::npos) {
-        string substring(s.substr(prev_pos, pos - prev_pos));
-        output.emplace_back(substring);
-        prev_pos = ++pos;
-    }
-    output.emplace_back(s.substr(prev_pos, pos - prev_pos)); // Last word
-    return output;
+ipdb::BaseStationInfo ipdb::BaseStation::FindInfo(const sockaddr_storage &addr, const string &language) const {
+    return info1<BaseStationInfo>(addr, language, schema);
 }
 
-vector<string> ipdb::Reader::find1(const string &addr, const string &language) {
-    if (meta.Languages.find(language) == meta.Languages.end()) {
-        throw ErrNoSupportLanguage;
-    }
-    auto off = meta.Languages[language];
-    auto body = find0(addr);
-    auto tmp = split(body, "\t");
-    if (off + meta.Fields.size() > tmp.size()) {
-        throw ErrDatabaseError;
-    }
-    vector<string> result;
-    for (auto i = tmp.begin() + off; i != tmp.begin() + off + meta.Fields.size(); ++i) {
-        result.emplace_back(*i);
-    }
-    return result;
+shared_ptr<const ipdb::BaseStationInfo> ipdb::BaseStation::FindSharedInfo(const string &addr, const string &language) const {
+    return findInfo<BaseStationInfo>(addr, language, schema);
 }
 
-map<string, string> ipdb::Reader::FindMap(const string &addr, const string &language) {
-    auto res = find1(addr, language);
-    map<string, string> info;
-    auto k = 0;
-    for (auto &v : res) {
-        info[meta.Fields[k++]] = v;
-    }
-    return info;
+shared_ptr<const ipdb::BaseStationInfo> ipdb::BaseStation::FindSharedInfo(const in_addr &addr, const string &language) const {
+    return findInfo<BaseStationInfo>(addr, language, schema);
 }
 
-vector<string> ipdb::Reader::Find(const string &addr, const string &language) {
-    return find1(addr, language);
+shared_ptr<const ipdb::BaseStationInfo> ipdb::BaseStation::FindSharedInfo(const in6_addr &addr, const string &language) const {
+    return findInfo<BaseStationInfo>(addr, language, schema);
 }
 
-bool ipdb::Reader::IsIPv6Support() const {
-    return (meta.IPVersion & IPv6) == IPv6;
+shared_ptr<const ipdb::BaseStationInfo> ipdb::BaseStation::FindSharedInfo(uint32_t addr, const string &language) const {
+    return findInfo<BaseStationInfo>(addr, language, schema);
 }
 
-bool ipdb::Reader::IsIPv4Support() const {
-    return (meta.IPVersion & IPv4) == IPv4;
+shared_ptr<const ipdb::BaseStationInfo> ipdb::BaseStation::FindSharedInfo(const sockaddr_storage &addr, const string &language) const {
+    return findInfo<BaseStationInfo>(addr, language, schema);
 }
 
-ipdb::Reader::Reader(const string &file) {
-    ifstream fs(file, ios::binary | ios::in);
-    if (fs.tellg() == -1) {
-        throw ErrFileSize;
-    }
-    fs.seekg(0, ios::end);
-    auto fsize = fs.tellg();
-    uint32_t metaLength = 0ul;
-    fs.seekg(0, ios::beg);
-    fs.read((char *) &metaLength, 4);
-    metaLength = ntohl(metaLength);
-    string bb;
-    bb.resize(metaLength);
-    fs.read(&bb[0], metaLength);
-    meta.Parse(bb);
-    if (meta.Languages.empty() || meta.Fields.empty()) {
-        throw ErrMetaData;
-    }
-    if (fsize != (4 + metaLength + meta.TotalSize)) {
-        throw ErrFileSize;
-    }
-    fileSize = (int) fsize;
-    auto dataLen = (int) fsize - 4 - metaLength;
-    data = shared_ptr<u_char>(new u_char[dataLen], std::default_delete<u_char[]>());;
-    fs.read((char *) data.get(), dataLen);
-    dataSize = dataLen;
-    auto node = 0;
-    for (auto i = 0; i < 96 && node < meta.NodeCount; ++i) {
-        if (i >= 80) {
-            node = readNode(node, 1);
-        } else {
-            node = readNode(node, 0);
-        }
-    }
-    v4offset = node;
+ipdb::Status ipdb::BaseStation::TryFindInfo(const string &addr, const string &language, BaseStationInfo &info) const {
+    return info0(addr, language, schema, info);
 }
 
-ipdb::Reader::~Reader() = default;
+ipdb::Status ipdb::BaseStation::TryFindInfo(const in_addr &addr, const string &language, BaseStationInfo &info) const {
+    return info0(addr, language, schema, info);
+}
 
-uint64_t ipdb::Reader::BuildTime() const {
-    return meta.Build;
+ipdb::Status ipdb::BaseStation::TryFindInfo(const in6_addr &addr, const string &language, BaseStationInfo &info) const {
+    return info0(addr, language, schema, info);
 }
 
-vector<string> ipdb::Reader::Languages() {
-    vector<string> ls;
-    for (const auto &i:meta.Languages) {
-        ls.emplace_back(i.first);
+ipdb::Status ipdb::BaseStation::TryFindInfo(uint32_t addr, const string &language, BaseStationInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::Status ipdb::BaseStation::TryFindInfo(const sockaddr_storage &addr, const string &language, BaseStationInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::DistrictInfo::DistrictInfo(const vector<string> &data, const vector<string> &fields) {
+    for (size_t i = 0; i < fields.size() && i < data.size(); ++i) {
+        auto field = Field(fields[i]);
+        if (field) {
+            this->*field = data[i];
+        }
     }
-    return ls;
 }
 
-vector<string> ipdb::Reader::Fields() const {
-    return meta.Fields;
+ipdb::DistrictInfo::DistrictInfo(const RecordView &view, const Schema<DistrictInfo> &schema) {
+    auto body = view.Record();
+    string_view::size_type begin = 0;
+    for (size_t i = 0; i < schema.size() && i < view.Size(); ++i) {
+        auto end = body.find('\t', begin);
+        if (schema[i]) {
+            this->*schema[i] = string(body.substr(begin, end == string_view::npos ? string_view::npos : end - begin));
+        }
+        begin = end + 1;
+    }
 }
 
-ipdb::ASNInfo::ASNInfo(const vector<string> &data, const vector<string> &fields) {
-    auto i = fields.begin();
-    auto j = data.begin();
-    for (; i != fields.end() && j != data.end(); ++i, ++j) {
-        if (*i == "asn")asn = *j;
-        else if (*i == "reg")reg = *j;
-        else if (*i == "cc")cc = *j;
-        else if (*i == "net")net = *j;
-        else if (*i == "org")org = *j;
-        else if (*i == "type")type = *j;
-        else if (*i == "domain")domain = *j;
+string ipdb::DistrictInfo::*ipdb::DistrictInfo::Field(string_view name) {
+    static const pair<string_view, string DistrictInfo::*> fields[] = {
+            {"country_name", &DistrictInfo::country_name},
+            {"region_name", &DistrictInfo::region_name},
+            {"city_name", &DistrictInfo::city_name},
+            {"district_name", &DistrictInfo::district_name},
+            {"china_admin_code", &DistrictInfo::china_admin_code},
+            {"covering_radius", &DistrictInfo::covering_radius},
+            {"latitude", &DistrictInfo::latitude},
+            {"longitude", &DistrictInfo::longitude},
+    };
+    for (auto &field : fields) {
+        if (field.first == name) {
+            return field.second;
+        }
     }
+    return nullptr;
 }
 
-string ipdb::ASNInfo::GetAsn() { return asn; }
+string ipdb::DistrictInfo::GetCountryName() const { return country_name; }
 
-string ipdb::ASNInfo::GetReg() { return reg; }
+string ipdb::DistrictInfo::GetRegionName() const { return region_name; }
 
-string ipdb::ASNInfo::GetCc() { return cc; }
+string ipdb::DistrictInfo::GetCityName() const { return city_name; }
 
-string ipdb::ASNInfo::GetNet() { return net; }
+string ipdb::DistrictInfo::GetDistrictName() const { return district_name; }
 
-string ipdb::ASNInfo::GetOrg() { return org; }
+string ipdb::DistrictInfo::GetChinaAdminCode() const { return china_admin_code; }
 
-string ipdb::ASNInfo::GetType() { return type; }
+string ipdb::DistrictInfo::GetCoveringRadius() const { return covering_radius; }
 
-string ipdb::ASNInfo::GetDomain() { return domain; }
+string ipdb::DistrictInfo::GetLatitude() const { return latitude; }
 
-string ipdb::ASNInfo::str() {
+string ipdb::DistrictInfo::GetLongitude() const { return longitude; }
+
+string ipdb::DistrictInfo::str() const {
     stringstream sb;
-    sb << "asn: " << asn << endl;
-    sb << "reg: " << reg << endl;
-    sb << "cc: " << cc << endl;
-    sb << "net: " << net << endl;
-    sb << "org: " << org << endl;
-    sb << "type: " << type << endl;
-    sb << "domain: " << domain << endl;
+    sb << "country_name: " << country_name << endl;
+    sb << "region_name: " << region_name << endl;
+    sb << "city_name: " << city_name << endl;
+    sb << "district_name: " << district_name << endl;
+    sb << "china_admin_code: " << china_admin_code << endl;
+    sb << "covering_radius: " << covering_radius << endl;
+    sb << "latitude: " << latitude << endl;
+    sb << "longitude: " << longitude << endl;
     return sb.str();
 }
 
-ipdb::CityInfo::CityInfo(const vector<string> &data, const vector<string> &fields) {
-    auto i = fields.begin();
-    auto j = data.begin();
-    for (; i != fields.end() && j != data.end(); ++i, ++j) {
-        if (*i == "country_name") { country_name = *j; }
-        else if (*i == "region_name") { region_name = *j; }
-        else if (*i == "city_name") { city_name = *j; }
-        else if (*i == "district_name") { district_name = *j; }
-        else if (*i == "owner_domain") { owner_domain = *j; }
-        else if (*i == "isp_domain") { isp_domain = *j; }
-        else if (*i == "latitude") { latitude = *j; }
-        else if (*i == "longitude") { longitude = *j; }
-        else if (*i == "timezone") { timezone = *j; }
-        else if (*i == "utc_offset") { utc_offset = *j; }
-        else if (*i == "china_admin_code") { china_admin_code = *j; }
-        else if (*i == "idd_code") { idd_code = *j; }
-        else if (*i == "country_code") { country_code = *j; }
-        else if (*i == "continent_code") { continent_code = *j; }
-        else if (*i == "idc") { idc = *j; }
-        else if (*i == "base_station") { base_station = *j; }
-        else if (*i == "country_code3") { country_code3 = *j; }
-        else if (*i == "european_union") { european_union = *j; }
-        else if (*i == "currency_code") { currency_code = *j; }
-        else if (*i == "currency_name") { currency_name = *j; }
-        else if (*i == "anycast") { anycast = *j; }
-        else if (*i == "line") { line = *j; }
-        else if (*i == "district_info") {
-            vector<string> names;
-            vector<string> values;
-            if (!j->empty()) {
-                Document doc;
-                doc.Parse(j->c_str());
-                if (doc.IsObject()) {
-                    for (const auto &o: doc.GetObject()) {
-                        values.emplace_back(o.name.GetString());
-                        names.emplace_back(o.value.GetString());
-                    }
-                }
-            }
-            district_info = make_shared<ipdb::DistrictInfo>(names, values);
-        } else if (*i == "route") { route = *j; }
-        else if (*i == "asn") { asn = *j; }
-        else if (*i == "asn_info") {
-            vector<shared_ptr<ipdb::ASNInfo>> ans_vector;
-            if (!j->empty()) {
-                Document doc;
-                doc.Parse(j->c_str());
-                if (doc.IsObject()) {
-                    for (const auto &array:doc.GetArray()) {
-                        vector<string> names;
-                        vector<string> values;
-                        for (const auto &o:array.GetObject()) {
-                            values.emplace_back(o.name.GetString());
-                            names.emplace_back(o.value.GetString());
-                        }
-                        ans_vector.emplace_back(make_shared<ipdb::ASNInfo>(names, values));
-                    }
-                }
-            }
-            asn_info = move(ans_vector);
-        } else if (*i == "area_code") { area_code = *j; }
-        else if (*i == "usage_type") { usage_type = *j; }
-    }
-}
-
-string ipdb::CityInfo::GetCountryName() { return country_name; }
+ipdb::District::District(const string &file, const ReaderOptions &options)
+        : Reader(file, options), schema(makeSchema<DistrictInfo>(Fields())) {}
 
-string ipdb::CityInfo::GetRegionName() { return region_name; }
+ipdb::District::District(int fd, const ReaderOptions &options)
+        : Reader(fd, options), schema(makeSchema<DistrictInfo>(Fields())) {}
 
-string ipdb::CityInfo::GetCityName() { return city_name; }
+ipdb::District::District(const void *buffer, size_t size, const ReaderOptions &options)
+        : Reader(buffer, size, options), schema(makeSchema<DistrictInfo>(Fields())) {}
 
-string ipdb::CityInfo::GetDistrictName() { return district_name; }
+ipdb::District::District(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options)
+        : Reader(move(buffer), size, options), schema(makeSchema<DistrictInfo>(Fields())) {}
 
-string ipdb::CityInfo::GetOwnerDomain() { return owner_domain; }
+ipdb::DistrictInfo ipdb::District::FindInfo(const string &addr, const string &language) const {
+    return info1<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetIspDomain() { return isp_domain; }
+ipdb::DistrictInfo ipdb::District::FindInfo(const in_addr &addr, const string &language) const {
+    return info1<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetLatitude() { return latitude; }
+ipdb::DistrictInfo ipdb::District::FindInfo(const in6_addr &addr, const string &language) const {
+    return info1<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetLongitude() { return longitude; }
+ipdb::DistrictInfo ipdb::District::FindInfo(uint32_t addr, const string &language) const {
+    return info1<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetTimezone() { return timezone; }
+ipdb::DistrictInfo ipdb::District::FindInfo(const sockaddr_storage &addr, const string &language) const {
+    return info1<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetUtcOffset() { return utc_offset; }
+shared_ptr<const ipdb::DistrictInfo> ipdb::District::FindSharedInfo(const string &addr, const string &language) const {
+    return findInfo<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetChinaAdminCode() { return china_admin_code; }
+shared_ptr<const ipdb::DistrictInfo> ipdb::District::FindSharedInfo(const in_addr &addr, const string &language) const {
+    return findInfo<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetIddCode() { return idd_code; }
+shared_ptr<const ipdb::DistrictInfo> ipdb::District::FindSharedInfo(const in6_addr &addr, const string &language) const {
+    return findInfo<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetCountryCode() { return country_code; }
+shared_ptr<const ipdb::DistrictInfo> ipdb::District::FindSharedInfo(uint32_t addr, const string &language) const {
+    return findInfo<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetContinentCode() { return continent_code; }
+shared_ptr<const ipdb::DistrictInfo> ipdb::District::FindSharedInfo(const sockaddr_storage &addr, const string &language) const {
+    return findInfo<DistrictInfo>(addr, language, schema);
+}
 
-string ipdb::CityInfo::GetIDC() { return idc; }
+ipdb::Status ipdb::District::TryFindInfo(const string &addr, const string &language, DistrictInfo &info) const {
+    return info0(addr, language, schema, info);
+}
 
-string ipdb::CityInfo::GetBaseStation() { return base_station; }
+ipdb::Status ipdb::District::TryFindInfo(const in_addr &addr, const string &language, DistrictInfo &info) const {
+    return info0(addr, language, schema, info);
+}
 
-string ipdb::CityInfo::GetCountryCode3() { return country_code3; }
+ipdb::Status ipdb::District::TryFindInfo(const in6_addr &addr, const string &language, DistrictInfo &info) const {
+    return info0(addr, language, schema, info);
+}
 
-string ipdb::CityInfo::GetEuropeanUnion() { return european_union; }
+ipdb::Status ipdb::District::TryFindInfo(uint32_t addr, const string &language, DistrictInfo &info) const {
+    return info0(addr, language, schema, info);
+}
 
-string ipdb::CityInfo::GetCurrencyCode() { return currency_code; }
+ipdb::Status ipdb::District::TryFindInfo(const sockaddr_storage &addr, const string &language, DistrictInfo &info) const {
+    return info0(addr, language, schema, info);
+}
 
-string ipdb::CityInfo::GetCurrencyName() { return currency_name; }
+ipdb::IDCInfo::IDCInfo(const vector<string> &data, const vector<string> &fields) {
+    for (size_t i = 0; i < fields.size() && i < data.size(); ++i) {
+        auto field = Field(fields[i]);
+        if (field) {
+            this->*field = data[i];
+        }
+    }
+}
 
-string ipdb::CityInfo::GetAnycast() { return anycast; }
+ipdb::IDCInfo::IDCInfo(const RecordView &view, const Schema<IDCInfo> &schema) {
+    auto body = view.Record();
+    string_view::size_type begin = 0;
+    for (size_t i = 0; i < schema.size() && i < view.Size(); ++i) {
+        auto end = body.find('\t', begin);
+        if (schema[i]) {
+            this->*schema[i] = string(body.substr(begin, end == string_view::npos ? string_view::npos : end - begin));
+        }
+        begin = end + 1;
+    }
+}
 
-string ipdb::CityInfo::GetLine() { return line; }
+string ipdb::IDCInfo::*ipdb::IDCInfo::Field(string_view name) {
+    static const pair<string_view, string IDCInfo::*> fields[] = {
+            {"country_name", &IDCInfo::country_name},
+            {"region_name", &IDCInfo::region_name},
+            {"city_name", &IDCInfo::city_name},
+            {"owner_domain", &IDCInfo::owner_domain},
+            {"isp_domain", &IDCInfo::isp_domain},
+            {"idc", &IDCInfo::idc},
+    };
+    for (auto &field : fields) {
+        if (field.first == name) {
+            return field.second;
+        }
+    }
+    return nullptr;
+}
 
-shared_ptr<ipdb::DistrictInfo> ipdb::CityInfo::GetDistrictInfo() { return district_info; }
+string ipdb::IDCInfo::GetCountryName() const { return country_name; }
 
-string ipdb::CityInfo::GetRoute() { return route; }
+string ipdb::IDCInfo::GetRegionName() const { return region_name; }
 
-string ipdb::CityInfo::GetASN() { return asn; }
+string ipdb::IDCInfo::GetCityName() const { return city_name; }
 
-vector<shared_ptr<ipdb::ASNInfo>> ipdb::CityInfo::GetASNInfo() { return asn_info; }
+string ipdb::IDCInfo::GetOwnerDomain() const { return owner_domain; }
 
-string ipdb::CityInfo::GetAreaCode() { return area_code; }
+string ipdb::IDCInfo::GetIspDomain() const { return isp_domain; }
 
-string ipdb::CityInfo::GetUsageType() { return usage_type; }
+string ipdb::IDCInfo::GetIDC() const { return idc; }
 
-string ipdb::CityInfo::str() {
+string ipdb::IDCInfo::str() const {
     stringstream sb;
     sb << "country_name: " << country_name << endl;
     sb << "region_name: " << region_name << endl;
     sb << "city_name: " << city_name << endl;
-    sb << "district_name: " << district_name << endl;
     sb << "owner_domain: " << owner_domain << endl;
     sb << "isp_domain: " << isp_domain << endl;
-    sb << "latitude: " << latitude << endl;
-    sb << "longitude: " << longitude << endl;
-    sb << "timezone: " << timezone << endl;
-    sb << "utc_offset: " << utc_offset << endl;
-    sb << "china_admin_code: " << china_admin_code << endl;
-    sb << "idd_code: " << idd_code << endl;
-    sb << "country_code: " << country_code << endl;
-    sb << "continent_code: " << continent_code << endl;
     sb << "idc: " << idc << endl;
-    sb << "base_station: " << base_station << endl;
-    sb << "country_code3: " << country_code3 << endl;
-    sb << "european_union: " << european_union << endl;
-    sb << "currency_code: " << currency_code << endl;
-    sb << "currency_name: " << currency_name << endl;
-    sb << "anycast: " << anycast << endl;
-    sb << "line: " << line << endl;
-    if (district_info) sb << "district_info: " << district_info->str() << endl;
-    sb << "route: " << route << endl;
-    sb << "asn: " << asn << endl;
-    for (const auto &i:asn_info)
-        sb << "asn_info: " << i->str() << endl;
-    sb << "area_code: " << area_code << endl;
-    sb << "usage_type: " << usage_type << endl;
     return sb.str();
 }
 
-ipdb::City::City(const string &file) : Reader(file) {}
+ipdb::IDC::IDC(const string &file, const ReaderOptions &options)
+        : Reader(file, options), schema(makeSchema<IDCInfo>(Fields())) {}
+
+ipdb::IDC::IDC(int fd, const ReaderOptions &options)
+        : Reader(fd, options), schema(makeSchema<IDCInfo>(Fields())) {}
+
+ipdb::IDC::IDC(const void *buffer, size_t size, const ReaderOptions &options)
+        : Reader(buffer, size, options), schema(makeSchema<IDCInfo>(Fields())) {}
+
+ipdb::IDC::IDC(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options)
+        : Reader(move(buffer), size, options), schema(makeSchema<IDCInfo>(Fields())) {}
 
-ipdb::CityInfo ipdb::City::FindInfo(const string &addr, const string &language) {
-    return CityInfo(Find(addr, language), this->Fields());
+ipdb::IDCInfo ipdb::IDC::FindInfo(const string &addr, const string &language) const {
+    return info1<IDCInfo>(addr, language, schema);
 }
 
-ipdb::BaseStationInfo::BaseStationInfo(const vector<string> &data, const vector<string> &fields) {
-    auto i = fields.begin();
-    auto j = data.begin();
-    for (; i != fields.end() && j != data.end(); ++i, ++j) {
-        if (*i == "country_name") { country_name = *j; }
-        else if (*i == "region_name") { region_name = *j; }
-        else if (*i == "city_name") { city_name = *j; }
-        else if (*i == "owner_domain") { owner_domain = *j; }
-        else if (*i == "isp_domain") { isp_domain = *j; }
-        else if (*i == "base_station") { base_station = *j; }
-    }
+ipdb::IDCInfo ipdb::IDC::FindInfo(const in_addr &addr, const string &language) const {
+    return info1<IDCInfo>(addr, language, schema);
 }
 
-string ipdb::BaseStationInfo::GetCountryName() { return country_name; }
+ipdb::IDCInfo ipdb::IDC::FindInfo(const in6_addr &addr, const string &language) const {
+    return info1<IDCInfo>(addr, language, schema);
+}
 
-string ipdb::BaseStationInfo::GetRegionName() { return region_name; }
+ipdb::IDCInfo ipdb::IDC::FindInfo(uint32_t addr, const string &language) const {
+    return info1<IDCInfo>(addr, language, schema);
+}
 
-string ipdb::BaseStationInfo::GetCityName() { return city_name; }
+ipdb::IDCInfo ipdb::IDC::FindInfo(const sockaddr_storage &addr, const string &language) const {
+    return info1<IDCInfo>(addr, language, schema);
+}
 
-string ipdb::BaseStationInfo::GetOwnerDomain() { return owner_domain; }
+shared_ptr<const ipdb::IDCInfo> ipdb::IDC::FindSharedInfo(const string &addr, const string &language) const {
+    return findInfo<IDCInfo>(addr, language, schema);
+}
 
-string ipdb::BaseStationInfo::GetIspDomain() { return isp_domain; }
+shared_ptr<const ipdb::IDCInfo> ipdb::IDC::FindSharedInfo(const in_addr &addr, const string &language) const {
+    return findInfo<IDCInfo>(addr, language, schema);
+}
 
-string ipdb::BaseStationInfo::GetBaseStation() { return base_station; }
+shared_ptr<const ipdb::IDCInfo> ipdb::IDC::FindSharedInfo(const in6_addr &addr, const string &language) const {
+    return findInfo<IDCInfo>(addr, language, schema);
+}
 
-string ipdb::BaseStationInfo::str() {
-    stringstream sb;
-    sb << "country_name: " << country_name << endl;
-    sb << "region_name: " << region_name << endl;
-    sb << "city_name: " << city_name << endl;
-    sb << "owner_domain: " << owner_domain << endl;
-    sb << "isp_domain: " << isp_domain << endl;
-    sb << "base_station: " << base_station << endl;
-    return sb.str();
+shared_ptr<const ipdb::IDCInfo> ipdb::IDC::FindSharedInfo(uint32_t addr, const string &language) const {
+    return findInfo<IDCInfo>(addr, language, schema);
 }
 
-ipdb::BaseStation::BaseStation(const string &file) : Reader(file) {}
+shared_ptr<const ipdb::IDCInfo> ipdb::IDC::FindSharedInfo(const sockaddr_storage &addr, const string &language) const {
+    return findInfo<IDCInfo>(addr, language, schema);
+}
 
-ipdb::BaseStationInfo ipdb::BaseStation::FindInfo(const string &addr, const string &language) {
-    return BaseStationInfo(Find(addr, language), this->Fields());
+ipdb::Status ipdb::IDC::TryFindInfo(const string &addr, const string &language, IDCInfo &info) const {
+    return info0(addr, language, schema, info);
 }
 
-ipdb::DistrictInfo::DistrictInfo(const vector<string> &data, const vector<string> &fields) {
-    auto i = fields.begin();
-    auto j = data.begin();
-    for (; i != fields.end() && j != data.end(); ++i, ++j) {
-        if (*i == "country_name") { country_name = *j; }
-        else if (*i == "region_name") { region_name = *j; }
-        else if (*i == "city_name") { city_name = *j; }
-        else if (*i == "district_name") { district_name = *j; }
-        else if (*i == "china_admin_code") { china_admin_code = *j; }
-        else if (*i == "covering_radius") { covering_radius = *j; }
-        else if (*i == "latitude") { latitude = *j; }
-        else if (*i == "longitude") { longitude = *j; }
-    }
+ipdb::Status ipdb::IDC::TryFindInfo(const in_addr &addr, const string &language, IDCInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::Status ipdb::IDC::TryFindInfo(const in6_addr &addr, const string &language, IDCInfo &info) const {
+    return info0(addr, language, schema, info);
+}
+
+ipdb::Status ipdb::IDC::TryFindInfo(uint32_t addr, const string &language, IDCInfo &info) const {
+    return info0(addr, language, schema, info);
 }
 
-string ipdb::DistrictInfo::GetCountryName() { return country_name; }
+ipdb::Status ipdb::IDC::TryFindInfo(const sockaddr_storage &addr, const string &language, IDCInfo &info) const {
+    return info0(addr, language, schema, info);
+}
 
-string ipdb::DistrictInfo::GetRegionName() { return region_name; }
+ipdb::MultiReader::MultiReader(vector<shared_ptr<const Reader>> readers) : readers(move(readers)) {
+    for (auto &reader : this->readers) {
+        if (!reader) {
+            throw ErrReaderOptions;
+        }
+    }
+}
 
-string ipdb::DistrictInfo::GetCityName() { return city_name; }
+size_t ipdb::MultiReader::Size() const {
+    return readers.size();
+}
 
-string ipdb::DistrictInfo::GetDistrictName() { return district_name; }
+const ipdb::Reader &ipdb::MultiReader::Get(size_t index) const {
+    return *readers.at(index);
+}
 
-string ipdb::DistrictInfo::GetChinaAdminCode() { return china_admin_code; }
+ipdb::Status ipdb::MultiReader::find(int family, const u_char *ip, const string &language, MultiResult &result) const {
+    auto count = readers.size();
+    auto bitCount = family == IPv4 ? 32 : 128;
+    result.Statuses.assign(count, Status::Ok);
+    result.Views.resize(count);
+    struct Walk {
+        const Reader *reader;
+        size_t index;
+        int offset; // language columns
+        int node;
+        int depth;
+    };
+    vector<Walk> walks;
+    walks.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto reader = readers[i].get();
+        result.Views[i] = RecordView();
+        auto lang = reader->meta.Languages.find(language);
+        if (lang == reader->meta.Languages.end()) {
+            result.Statuses[i] = Status::NoSupportLanguage;
+        } else if (family == IPv4 ? !reader->IsIPv4Support() : !reader->IsIPv6Support()) {
+            result.Statuses[i] = family == IPv4 ? Status::NoSupportIPv4 : Status::NoSupportIPv6;
+        } else {
+            Walk walk{reader, i, lang->second, 0, 0};
+            walk.node = reader->start(ip, bitCount, walk.depth);
+            walks.push_back(walk);
+            continue;
+        }
+        meterResult(reader->meter.get(), result.Statuses[i]);
+    }
+    // one step of every unfinished walk per round, like Reader::batch across databases instead of addresses
+    while (!walks.empty()) {
+        for (size_t w = 0; w < walks.size();) {
+            auto &walk = walks[w];
+            auto reader = walk.reader;
+            auto nodeCount = reader->meta.NodeCount;
+            if (walk.node > nodeCount || walk.depth == bitCount) {
+                auto &status = result.Statuses[walk.index];
+                string_view record;
+                if (walk.node <= nodeCount) {
+                    status = Status::DataNotExists;
+                } else {
+                    status = reader->resolve(walk.node, record);
+                    if (status == Status::Ok && !result.Views[walk.index].assign(
+                            record, walk.offset, reader->meta.Fields, Network(family, ip, walk.depth))) {
+                        status = Status::DatabaseError;
+                    }
+                }
+                meterWalk(reader->meter.get(), family, walk.depth, record.size());
+                meterResult(reader->meter.get(), status);
+                walk = walks.back();
+                walks.pop_back();
+                continue;
+            }
+            auto i = walk.depth++;
+            walk.node = reader->readNode(walk.node, ((0xFF & int(ip[i >> 3])) >> uint(7 - (i % 8))) & 1);
+            if (walk.node < nodeCount) {
+                __builtin_prefetch(reader->data + walk.node * 8);
+            }
+            ++w;
+        }
+    }
+    return Status::Ok;
+}
 
-string ipdb::DistrictInfo::GetCoveringRadius() { return covering_radius; }
+ipdb::MultiResult ipdb::MultiReader::Find(const string &addr, const string &language) const {
+    MultiResult result;
+    check(TryFind(addr, language, result));
+    return result;
+}
 
-string ipdb::DistrictInfo::GetLatitude() { return latitude; }
+ipdb::Status ipdb::MultiReader::TryFind(const string &addr, const string &language, MultiResult &result) const {
+    Address parsed;
+    ParseAddress(string_view(addr.c_str(), strnlen(addr.c_str(), addr.size())), parsed);
+    return TryFind(parsed, language, result);
+}
 
-string ipdb::DistrictInfo::GetLongitude() { return longitude; }
+ipdb::Status ipdb::MultiReader::TryFind(const in_addr &addr, const string &language, MultiResult &result) const {
+    return find(IPv4, (const u_char *) &addr.s_addr, language, result);
+}
 
-string ipdb::DistrictInfo::str() {
-    stringstream sb;
-    sb << "country_name: " << country_name << endl;
-    sb << "region_name: " << region_name << endl;
-    sb << "city_name: " << city_name << endl;
-    sb << "district_name: " << district_name << endl;
-    sb << "china_admin_code: " << china_admin_code << endl;
-    sb << "covering_radius: " << covering_radius << endl;
-    sb << "latitude: " << latitude << endl;
-    sb << "longitude: " << longitude << endl;
-    return sb.str();
+ipdb::Status ipdb::MultiReader::TryFind(const in6_addr &addr, const string &language, MultiResult &result) const {
+    return find(IPv6, (const u_char *) &addr.s6_addr, language, result);
 }
 
-ipdb::District::District(const string &file) : Reader(file) {}
+ipdb::Status ipdb::MultiReader::TryFind(const Address &addr, const string &language, MultiResult &result) const {
+    if (addr.Family != IPv4 && addr.Family != IPv6) {
+        return Status::IPFormat;
+    }
+    return find(addr.Family, addr.Bytes, language, result);
+}
 
-ipdb::DistrictInfo ipdb::District::FindInfo(const string &addr, const string &language) {
-    return DistrictInfo(Find(addr, language), this->Fields());
+ipdb::Writer::Writer(const vector<string> &fields, const vector<string> &languages)
+        : fields(fields), languages(languages), build((uint64_t) time(nullptr)), children{empty, empty}, depths{0, 0} {
+    if (fields.empty() || languages.empty()) {
+        throw ErrMetaData;
+    }
 }
 
-ipdb::IDCInfo::IDCInfo(const vector<string> &data, const vector<string> &fields) {
-    auto i = fields.begin();
-    auto j = data.begin();
-    for (; i != fields.end() && j != data.end(); ++i, ++j) {
-        if (*i == "country_name") { country_name = *j; }
-        else if (*i == "region_name") { region_name = *j; }
-        else if (*i == "city_name") { city_name = *j; }
-        else if (*i == "owner_domain") { owner_domain = *j; }
-        else if (*i == "isp_domain") { isp_domain = *j; }
-        else if (*i == "idc") { idc = *j; }
+ipdb::Writer::Writer(const Reader &reader) : Writer(reader.meta.Fields, reader.Languages()) {
+    build = reader.meta.Build;
+    for (auto family : {IPv4, IPv6}) {
+        if ((family == IPv4 && !reader.IsIPv4Support()) || (family == IPv6 && !reader.IsIPv6Support())) {
+            continue;
+        }
+        // the trie is shared by all languages, so the iterators visit the same networks in step
+        vector<LeafIterator> its;
+        for (auto &language : languages) {
+            its.push_back(reader.Leaves(family, language));
+        }
+        Network network;
+        RecordView view;
+        vector<vector<string>> values(languages.size());
+        while (its[0].Next(network, view)) {
+            values[0] = view.ToVector();
+            for (size_t l = 1; l < its.size(); ++l) {
+                its[l].Next(network, view);
+                values[l] = view.ToVector();
+            }
+            Insert(network, values);
+        }
     }
 }
 
-string ipdb::IDCInfo::GetCountryName() { return country_name; }
+int ipdb::Writer::newNode(int value, u_char depth) {
+    auto node = (int) children.size() / 2;
+    children.push_back(value);
+    children.push_back(value);
+    depths.push_back(depth);
+    depths.push_back(depth);
+    return node;
+}
 
-string ipdb::IDCInfo::GetRegionName() { return region_name; }
+void ipdb::Writer::assign(int slot, int record, int prefixLength) {
+    auto c = children[slot];
+    if (c > empty) {
+        assign(c * 2, record, prefixLength);
+        assign(c * 2 + 1, record, prefixLength);
+    } else if (c == empty || depths[slot] <= prefixLength) {
+        children[slot] = -(record + 2);
+        depths[slot] = u_char(prefixLength);
+    }
+}
 
-string ipdb::IDCInfo::GetCityName() { return city_name; }
+void ipdb::Writer::Insert(const Network &network, const vector<vector<string>> &values, uint64_t weight) {
+    if (values.size() != languages.size()) {
+        throw ErrRecordFormat;
+    }
+    string record;
+    for (size_t l = 0; l < values.size(); ++l) {
+        if (values[l].size() != fields.size()) {
+            throw ErrRecordFormat;
+        }
+        for (size_t f = 0; f < values[l].size(); ++f) {
+            if (values[l][f].find_first_of("\t\n") != string::npos) {
+                throw ErrRecordFormat;
+            }
+            if (l || f) {
+                record += '\t';
+            }
+            record += values[l][f];
+        }
+    }
+    if (record.size() > 0xFFFF) {
+        throw ErrRecordFormat;
+    }
+    auto found = recordIndex.find(record);
+    int id;
+    if (found == recordIndex.end()) {
+        id = (int) records.size();
+        recordIndex[record] = id;
+        records.push_back(record);
+        weights.push_back(0);
+    } else {
+        id = found->second;
+    }
+    weights[id] += weight;
+
+    // IPv4 lives under ::ffff:0:0/96, where Reader finds it
+    u_char full[16]{};
+    auto bitCount = network.PrefixLength;
+    if (network.Family == IPv4) {
+        full[10] = full[11] = 0xFF;
+        memcpy(full + 12, network.Address, 4);
+        bitCount += 96;
+        ipVersion |= IPv4;
+    } else {
+        memcpy(full, network.Address, 16);
+        ipVersion |= IPv6;
+    }
+    if (bitCount == 0) {
+        assign(0, id, 0);
+        assign(1, id, 0);
+        return;
+    }
+    auto node = 0;
+    for (auto i = 0; i < bitCount - 1; ++i) {
+        auto slot = node * 2 + ((full[i >> 3] >> uint(7 - i % 8)) & 1);
+        if (children[slot] <= empty) {
+            // split the leaf (or the empty slot) so the more specific network can go below it
+            auto next = newNode(children[slot], depths[slot]);
+            children[slot] = next;
+        }
+        node = children[slot];
+    }
+    assign(node * 2 + ((full[(bitCount - 1) >> 3] >> uint(7 - (bitCount - 1) % 8)) & 1), id, bitCount);
+}
 
-string ipdb::IDCInfo::GetOwnerDomain() { return owner_domain; }
+void ipdb::Writer::Insert(const string &cidr, const vector<vector<string>> &values, uint64_t weight) {
+    Insert(Network::Parse(cidr), values, weight);
+}
 
-string ipdb::IDCInfo::GetIspDomain() { return isp_domain; }
+void ipdb::Writer::SetBuild(uint64_t value) {
+    build = value;
+}
 
-string ipdb::IDCInfo::GetIDC() { return idc; }
+void ipdb::Writer::SetLayout(NodeLayout value) {
+    layout = value;
+}
 
-string ipdb::IDCInfo::str() {
-    stringstream sb;
-    sb << "country_name: " << country_name << endl;
-    sb << "region_name: " << region_name << endl;
-    sb << "city_name: " << city_name << endl;
-    sb << "owner_domain: " << owner_domain << endl;
-    sb << "isp_domain: " << isp_domain << endl;
-    sb << "idc: " << idc << endl;
-    return sb.str();
+// Folds subtrees whose leaves all hold the same value into that value, returns the slot's new value.
+static int compact(vector<int> &children, int slot) {
+    auto c = children[slot];
+    if (c >= 0) {
+        auto left = compact(children, c * 2);
+        auto right = compact(children, c * 2 + 1);
+        if (left == right && left < 0) {
+            children[slot] = left;
+        }
+    }
+    return children[slot];
+}
+
+static void vanEmdeBoas(const vector<int> &children, int node, int height, vector<int> &order, vector<int> &frontier) {
+    if (height == 1) {
+        order.push_back(node);
+        for (auto bit = 0; bit < 2; ++bit) {
+            if (children[node * 2 + bit] >= 0) {
+                frontier.push_back(children[node * 2 + bit]);
+            }
+        }
+        return;
+    }
+    vector<int> middle;
+    vanEmdeBoas(children, node, height / 2, order, middle);
+    for (auto m : middle) {
+        vanEmdeBoas(children, m, height - height / 2, order, frontier);
+    }
 }
 
-ipdb::IDC::IDC(const string &file) : Reader(file) {}
+string ipdb::Writer::Bytes() const {
+    // the root itself stays a node, Reader starts every walk there
+    auto children = this->children;
+    compact(children, 0);
+    compact(children, 1);
+    vector<int> order;
+    if (layout == NodeLayout::BreadthFirst) {
+        order.push_back(0);
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (auto bit = 0; bit < 2; ++bit) {
+                if (children[order[i] * 2 + bit] >= 0) {
+                    order.push_back(children[order[i] * 2 + bit]);
+                }
+            }
+        }
+    } else if (layout == NodeLayout::DepthFirst) {
+        vector<int> stack{0};
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            for (auto bit = 1; bit >= 0; --bit) {
+                if (children[node * 2 + bit] >= 0) {
+                    stack.push_back(children[node * 2 + bit]);
+                }
+            }
+        }
+    } else {
+        vector<int> frontier;
+        vanEmdeBoas(children, 0, 129, order, frontier);
+    }
+    auto nodeCount = (int) order.size();
+    vector<int> position(children.size() / 2, -1);
+    for (auto i = 0; i < nodeCount; ++i) {
+        position[order[i]] = i;
+    }
+
+    // hot records first, the data section opens with node nodeCount, which loops on itself as "no data"
+    vector<int> rank(records.size());
+    for (size_t i = 0; i < rank.size(); ++i) {
+        rank[i] = (int) i;
+    }
+    stable_sort(rank.begin(), rank.end(), [this](int a, int b) { return weights[a] > weights[b]; });
+    string body((size_t) nodeCount * 8 + 8, '\0');
+    auto put = [&body](size_t off, uint32_t v) {
+        v = htonl(v);
+        memcpy(&body[off], &v, 4);
+    };
+    put((size_t) nodeCount * 8, (uint32_t) nodeCount);
+    put((size_t) nodeCount * 8 + 4, (uint32_t) nodeCount);
+    vector<uint32_t> offsets(records.size());
+    for (auto id : rank) {
+        offsets[id] = (uint32_t) (body.size() - (size_t) nodeCount * 8);
+        body.push_back(char(records[id].size() >> 8));
+        body.push_back(char(records[id].size() & 0xFF));
+        body += records[id];
+    }
+    if (body.size() > 0x7FFFFFFF) {
+        throw ErrFileSize;
+    }
+    for (auto i = 0; i < nodeCount; ++i) {
+        for (auto bit = 0; bit < 2; ++bit) {
+            auto c = children[order[i] * 2 + bit];
+            uint32_t value;
+            if (c == empty) {
+                value = (uint32_t) nodeCount;
+            } else if (c < empty) {
+                value = (uint32_t) nodeCount + offsets[-c - 2];
+            } else {
+                value = (uint32_t) position[c];
+            }
+            put((size_t) i * 8 + bit * 4, value);
+        }
+    }
+
+    StringBuffer sb;
+    rapidjson::Writer<StringBuffer> w(sb);
+    w.StartObject();
+    w.Key("build");
+    w.Uint64(build);
+    w.Key("ip_version");
+    w.Uint(ipVersion);
+    w.Key("languages");
+    w.StartObject();
+    for (size_t l = 0; l < languages.size(); ++l) {
+        w.Key(languages[l].c_str());
+        w.Int(int(l * fields.size()));
+    }
+    w.EndObject();
+    w.Key("node_count");
+    w.Int(nodeCount);
+    w.Key("total_size");
+    w.Int((int) body.size());
+    w.Key("fields");
+    w.StartArray();
+    for (auto &field : fields) {
+        w.String(field.c_str());
+    }
+    w.EndArray();
+    w.EndObject();
+
+    string out(4, '\0');
+    uint32_t metaLength = htonl((uint32_t) sb.GetSize());
+    memcpy(&out[0], &metaLength, 4);
+    out.append(sb.GetString(), sb.GetSize());
+    out += body;
+    return out;
+}
 
-ipdb::IDCInfo ipdb::IDC::FindInfo(const string &addr, const string &language) {
-    return IDCInfo(Find(addr, language), this->Fields());
+void ipdb::Writer::Save(const string &file) const {
+    auto bytes = Bytes();
+    ofstream fs(file, ios::binary | ios::out | ios::trunc);
+    fs.write(bytes.data(), bytes.size());
+    if (!fs) {
+        throw ErrFileSize;
+    }
 }
@@ -6,8 +6,15 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 namespace ipdb {
 #define  IPv4  0x01
@@ -21,8 +28,29 @@ namespace ipdb {
 #define ErrNoSupportIPv4 "IPv4 not support"
 #define ErrNoSupportIPv6 "IPv6 not support"
 #define ErrDataNotExists "data is not exists"
+#define ErrReaderOptions "reader options error."
+#define ErrRecordFormat "record format error."
+#define ErrNoSupportField "field not support."
+#define ErrHugePages "huge pages not available."
+#define ErrMemoryLock "memory lock error."
     using namespace std;
 
+    enum class Status {
+        Ok,
+        IPFormat,          // ErrIPFormat
+        NoSupportLanguage, // ErrNoSupportLanguage
+        NoSupportIPv4,     // ErrNoSupportIPv4
+        NoSupportIPv6,     // ErrNoSupportIPv6
+        DataNotExists,     // ErrDataNotExists
+        DatabaseError      // ErrDatabaseError
+    };
+
+    const char *StatusString(Status status); // the Err* message the throwing API uses for status
+
+    // Maps each database field index to the Info member it fills, null for fields the Info does not keep.
+    template<typename Info>
+    using Schema = vector<string Info::*>;
+
     class MetaData {
     public:
         uint64_t Build{};             //`json:"build"`
@@ -34,31 +62,511 @@ namespace ipdb {
         void Parse(const string &json);
     };
 
+    // Page backing of the loaded image; 2 MB pages cut the TLB misses of trie walks over large node arrays.
+    enum class HugePages {
+        None,
+        Transparent, // madvise(MADV_HUGEPAGE) on a 2 MB aligned heap copy, or on the mmap'ed file where the kernel maps files with THP
+        Explicit     // a heap copy in MAP_HUGETLB pages from the reserved pool (vm.nr_hugepages), not with mmap
+    };
+
+    // How single lookups walk the trie; both give the same matches and prefix lengths.
+    enum class TrieEngine {
+        Binary,  // one node array step per bit, straight over the loaded image
+        Poptrie  // built at load: the first 16 bits index a table, then one bitmap node per 6 bits
+    };
+
+    struct ReaderOptions {
+        bool mmap = false; // map the file read-only and shared instead of copying it into the heap
+        int v4TableBits = 0; // index the first 1-24 bits of IPv4 lookups with a 2^bits table, 0 disables
+        size_t cacheSize = 0; // keep up to cacheSize decoded FindInfo results, 0 disables
+        size_t rangeCacheSize = 0; // per-thread LRU of up to rangeCacheSize matched networks and their records, 0 disables
+        vector<string> tableLanguages; // decode every record of these languages into a RecordTable at load
+        int tableThreads = 0; // threads building the record tables, 0 uses one per core
+        HugePages hugePages = HugePages::None;
+        bool mlock = false; // lock the image in RAM against swap-out, throws ErrMemoryLock beyond RLIMIT_MEMLOCK
+        bool prefault = false; // with mmap, read the whole file in at load instead of page by page on first lookups
+        bool randomAccess = false; // with mmap, MADV_RANDOM on the node array: no read-ahead around walk page faults
+        TrieEngine engine = TrieEngine::Binary;
+        size_t indexBytes = 0; // keep built field indexes up to this many bytes, least recently used dropped first; 0 no limit
+        int indexThreads = 0; // threads building a field index, 0 uses one per core
+    };
+
+    class Network {
+    public:
+        int Family = IPv4;          // IPv4 or IPv6
+        u_char Address[16]{};       // network address in network byte order, IPv4 uses the first 4 bytes
+        int PrefixLength = 0;
+
+        Network() = default;
+
+        Network(int family, const u_char *ip, int prefixLength); // keeps the first prefixLength bits of ip
+
+        static Network Parse(const string &cidr); // "1.2.0.0/16", "2001:db8::/32", a bare address is a /32 or /128
+
+        bool Contains(const in_addr &addr) const;
+
+        bool Contains(const in6_addr &addr) const;
+
+        string str() const;         // e.g. "1.2.0.0/16"
+    };
+
+    // A textual address parsed by ParseAddress.
+    struct Address {
+        int Family = 0;             // IPv4, IPv6, or 0 if the text is not an address
+        u_char Bytes[16]{};         // network byte order, IPv4 uses the first 4 bytes
+    };
+
+    // Parses text with inet_pton's rules, telling IPv4 from IPv6 in one pass. Characters are classified
+    // with AVX2 or SSE4.2 when the CPU has them. Returns the family, 0 if text is not an address.
+    int ParseAddress(string_view text, Address &address);
+
+    // Parses every delimiter-separated token of buffer, appending one Address per token to out; returns the count.
+    // The buffer is classified 64 bytes at a time and the delimiters are found from the same masks.
+    size_t ParseAddresses(string_view buffer, char delimiter, vector<Address> &out);
+
+    // Fields of one language of a record, viewed in place inside the loaded database.
+    // Valid while the Reader that returned it is alive; copy with ToVector/ToMap to keep it longer.
+    class RecordView {
+        string_view body;
+        const vector<string> *fields = nullptr;
+        Network network;
+
+        bool assign(string_view record, int offset, const vector<string> &fields, const Network &network);
+
+        friend class Reader;
+
+        friend class MultiReader;
+    public:
+        RecordView() = default;
+
+        RecordView(string_view record, int offset, const vector<string> &fields, const Network &network = Network());
+
+        // The network the lookup matched, e.g. 27.190.24.0/24 for 27.190.24.9; every address in it has this record.
+        const Network &GetNetwork() const;
+
+        size_t Size() const;
+
+        bool Empty() const;
+
+        string_view Record() const; // the raw tab-separated columns of this language
+
+        string_view Get(size_t index) const; // empty if index is out of range
+
+        string_view Get(string_view name) const; // empty if the database has no such field
+
+        string_view operator[](size_t index) const;
+
+        string_view operator[](string_view name) const;
+
+        const vector<string> &Fields() const;
+
+        vector<string> ToVector() const;
+
+        map<string, string> ToMap() const;
+    };
+
+    struct CacheStats {
+        uint64_t Hits{};
+        uint64_t Misses{};
+        size_t Size{};
+        size_t Capacity{};
+    };
+
+    struct MemoryStats {
+        size_t Bytes{};         // image size
+        size_t HugePageBytes{}; // of the image's own mappings, backed by huge pages (from /proc/self/smaps)
+        bool Mapped{};          // ReaderOptions::mmap
+        bool Locked{};
+    };
+
+    struct TableStats {
+        size_t Records{}; // unique records in the data section, one table row each
+        size_t Strings{}; // interned values over all tables
+        size_t Bytes{};
+        double BuildSeconds{};
+    };
+
+    // Lookup counters of one Reader, see Reader::Metrics. They are only collected when the library is built with
+    // -DIPDB_METRICS; otherwise the counting code is compiled out and every snapshot is empty.
+    struct LookupMetrics {
+        static const int LatencyBuckets = 32;
+
+        bool Enabled{};
+        uint64_t Lookups[2]{};          // trie lookups by family, IPv4 then IPv6
+        uint64_t Results[7]{};          // lookups by Status: Results[Status::Ok] are hits, DataNotExists misses
+        uint64_t Depth[129]{};          // trie depth the walk stopped at, range cache hits skip the walk
+        uint64_t ResolveBytes{};        // record bytes read, length prefixes included
+        uint64_t Latency[LatencyBuckets]{}; // parse, walk and resolve time of single lookups (not FindBatch):
+                                            // bucket i counts calls under 2^i ns, the last one the rest
+        uint64_t LatencyNanoseconds{};  // sum
+
+        string Prometheus(const string &prefix = "ipdb") const; // text exposition format
+    };
+
+    class Meter;
+
+    class Poptrie;
+
+    // Every unique record of one language, decoded once at load and stored column by column.
+    // Equal values share one interned id, whose string_view points into the loaded database.
+    class RecordTable {
+        vector<string> fields;
+        vector<string_view> strings;
+        vector<vector<uint32_t>> columns; // columns[field][row] indexes strings
+
+        friend class Reader;
+    public:
+        size_t Rows() const;
+
+        const vector<string> &Fields() const;
+
+        uint32_t Id(uint32_t row, size_t field) const; // interned id, equal ids hold equal values
+
+        string_view Get(uint32_t row, size_t field) const;
+
+        string_view Get(uint32_t row, string_view name) const; // empty if the database has no such field
+
+        size_t Bytes() const;
+    };
+
+    // Sorted, disjoint address ranges, adjacent ranges merged. IPv4 is kept apart from IPv6 as in Reader::Leaves,
+    // so ::ffff:0:0/96 is never on the IPv6 side.
+    class RangeSet {
+        vector<pair<uint32_t, uint32_t>> v4; // first and last address, host byte order
+        vector<pair<unsigned __int128, unsigned __int128>> v6;
+
+        void add(const Network &network); // after every range already held
+
+        void append(const RangeSet &other); // whose ranges all follow these
+
+        friend class Reader;
+    public:
+        bool Empty() const;
+
+        size_t Size() const; // ranges
+
+        bool Contains(const in_addr &addr) const;
+
+        bool Contains(const in6_addr &addr) const;
+
+        RangeSet Union(const RangeSet &other) const;
+
+        RangeSet Intersect(const RangeSet &other) const;
+
+        RangeSet Subtract(const RangeSet &other) const;
+
+        vector<Network> Networks() const; // the fewest CIDR blocks covering the set, ascending, IPv4 first
+
+        size_t Bytes() const;
+    };
+
+    // The networks of every value of one field in one language, see Reader::Index.
+    class FieldIndex {
+        map<string, RangeSet, less<>> sets;
+
+        friend class Reader;
+    public:
+        const RangeSet &Get(string_view value) const; // empty if no network has value
+
+        vector<string> Values() const; // ascending
+
+        size_t Bytes() const;
+    };
+
+    class RecordCache;
+
+    class RangeCache;
+
+    class IndexCache;
+
+    class Reader;
+
+    // Depth-first walk over the leaves of one subtree of the trie, in ascending address order.
+    class LeafIterator {
+        struct Frame {
+            int node;
+            int depth;
+            u_char ip[16];
+        };
+        const Reader *reader = nullptr;
+        int family = IPv4;
+        int offset = 0;
+        vector<Frame> stack;
+
+        friend class Reader;
+    public:
+        // Advances to the next network that holds a record; false once the subtree is exhausted.
+        bool Next(Network &network, RecordView &record);
+    };
+
+    // A lookup bound to one language and a subset of its fields, see Reader::Prepare.
+    // Only the requested columns are extracted, in the order they were asked for.
+    class PreparedQuery {
+        const Reader *reader = nullptr;
+        vector<string> fields;
+        vector<pair<int, size_t>> columns; // record column, ascending, and its position in fields
+
+        template<typename T>
+        Status find0(const T &addr, vector<string_view> &result) const;
+
+        template<typename T>
+        vector<string> find1(const T &addr) const;
+
+        friend class Reader;
+    public:
+        const vector<string> &Fields() const;
+
+        vector<string> Find(const string &addr) const;
+
+        vector<string> Find(const in_addr &addr) const;
+
+        vector<string> Find(const in6_addr &addr) const;
+
+        vector<string> Find(uint32_t addr) const;
+
+        vector<string> Find(const sockaddr_storage &addr) const;
+
+        Status TryFind(const string &addr, vector<string_view> &result) const;
+
+        Status TryFind(const in_addr &addr, vector<string_view> &result) const;
+
+        Status TryFind(const in6_addr &addr, vector<string_view> &result) const;
+
+        Status TryFind(uint32_t addr, vector<string_view> &result) const;
+
+        Status TryFind(const sockaddr_storage &addr, vector<string_view> &result) const;
+    };
+
+
     class Reader {
         MetaData meta;
         int v4offset = 0;
         int fileSize = 0;
         int dataSize = 0;
-        shared_ptr<u_char> data = nullptr;
+        shared_ptr<void> image = nullptr; // owns the loaded file: a heap copy or a MAP_SHARED mapping
+        const u_char *data = nullptr;     // view of the node and record sections inside image
+        int v4TableBits = 0;
+        vector<int> v4table;              // node reached after the first v4TableBits bits of an IPv4 walk
+        vector<u_char> v4depth;           // depth of that node, less than v4TableBits when it is a leaf reached early
+        shared_ptr<Meter> meter = nullptr; // lookup counters, null unless built with IPDB_METRICS
+        MemoryStats memory;               // of image, HugePageBytes is read on demand by ImageStats
+        shared_ptr<const Poptrie> v4trie = nullptr; // TrieEngine::Poptrie
+        shared_ptr<const Poptrie> v6trie = nullptr;
+
+        shared_ptr<const Poptrie> buildTrie(int root, int bitCount) const;
+
+        shared_ptr<IndexCache> indexes = nullptr;
+
+        shared_ptr<const FieldIndex> buildIndex(const string &language, size_t column, int threads) const;
+
+        void buildV4Table(int node, int depth, uint32_t prefix);
+
+        int start(const u_char *ip, int bitCount, int &depth) const;
+
+        void load(const u_char *buf, size_t size);
+
+        void open(int fd, const ReaderOptions &options);
+
+        void setup(const ReaderOptions &options); // what options build over the loaded image
 
         int readNode(int node, int index) const;
 
-        string resolve(int node);
+        Status resolve(int node, string_view &body) const;
+
+        int search(const u_char *ip, int bitCount, int &depth) const; // a node <= meta.NodeCount is a miss
+
+        // the last info decoded from a range cache entry, tagged with the language columns it came from
+        struct InfoSlot {
+            const char *key = nullptr;
+            shared_ptr<const void> value = nullptr;
+        };
+
+        size_t rangeCacheSize = 0;
+        shared_ptr<const void> rangeCacheKey = nullptr; // one per reader, names its range cache in every thread
+
+        RangeCache &rangeCache() const;
+
+        vector<uint32_t> tableRecords; // sorted offsets of the unique records in data, a record's index is its row
+        map<string, RecordTable> tables;
+        double tableSeconds = 0;
 
-        int search(const u_char *ip, int bitCount) const;
+        void buildTables(const vector<string> &languages, int threads);
 
-        string find0(const string &addr);
+        Status find0(int family, const u_char *ip, InfoSlot **slot, string_view &record, Network &network) const;
 
-        vector<string> find1(const string &addr, const string &language);
+        Status find0(const string &addr, InfoSlot **slot, string_view &record, Network &network) const;
+
+        Status find0(const in_addr &addr, InfoSlot **slot, string_view &record, Network &network) const;
+
+        Status find0(const in6_addr &addr, InfoSlot **slot, string_view &record, Network &network) const;
+
+        Status find0(uint32_t addr, InfoSlot **slot, string_view &record, Network &network) const;
+
+        Status find0(const sockaddr_storage &addr, InfoSlot **slot, string_view &record, Network &network) const;
+
+        template<typename T>
+        Status view0(const T &addr, const string &language, RecordView &out, InfoSlot **slot = nullptr) const;
+
+        template<typename T>
+        RecordView view1(const T &addr, const string &language, InfoSlot **slot = nullptr) const;
+
+        template<typename T>
+        vector<string> find1(const T &addr, const string &language) const;
+
+        template<typename T>
+        Status tryFind0(const T &addr, const string &language, vector<string> &result) const;
+
+        template<typename T>
+        Status row0(const T &addr, const string &language, uint32_t &row) const;
+
+        template<typename T>
+        void batch(const T *addrs, size_t count, int bitCount, int offset, RecordView *out) const;
+
+        template<typename T>
+        void parallelFind(const T *addrs, size_t count, const string &language, RecordView *out, int threads) const;
+
+        LeafIterator leaves(int family, const string &language) const;
+
+        friend class LeafIterator;
+
+        friend class PreparedQuery;
+
+        friend class RangeCache;
+
+        friend class Writer;
+
+        friend class MultiReader;
+
+    protected:
+        shared_ptr<RecordCache> cache = nullptr;
+
+        template<typename Info, typename T>
+        Status findInfo0(const T &addr, const string &language, const Schema<Info> &schema,
+                         shared_ptr<const Info> &out) const;
+
+        template<typename Info, typename T>
+        shared_ptr<const Info> findInfo(const T &addr, const string &language, const Schema<Info> &schema) const;
+
+        template<typename Info, typename T>
+        Status info0(const T &addr, const string &language, const Schema<Info> &schema, Info &out) const;
+
+        template<typename Info, typename T>
+        Info info1(const T &addr, const string &language, const Schema<Info> &schema) const;
 
     public:
         ~Reader();
 
-        explicit Reader(const string &file);
+        explicit Reader(const string &file, const ReaderOptions &options = ReaderOptions());
+
+        // Reads or, with ReaderOptions::mmap, maps the whole file behind an open fd from offset 0; fd is not closed.
+        // Without mmap, pipes and sockets are read to their end; mmap needs a regular file and throws ErrFileSize.
+        explicit Reader(int fd, const ReaderOptions &options = ReaderOptions());
+
+        // Borrows size bytes at buffer without copying, e.g. an embedded blob or a shared-memory segment;
+        // the buffer must outlive the reader and every view taken from it. mmap or hugePages throw ErrReaderOptions.
+        Reader(const void *buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        // Shares ownership of buffer instead: it is released with the reader's last image reference.
+        Reader(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        vector<string> Find(const string &addr, const string &language) const;
+
+        vector<string> Find(const in_addr &addr, const string &language) const;
+
+        vector<string> Find(const in6_addr &addr, const string &language) const;
+
+        vector<string> Find(uint32_t addr, const string &language) const; // addr in host byte order
+
+        vector<string> Find(const sockaddr_storage &addr, const string &language) const;
+
+        RecordView FindView(const string &addr, const string &language) const;
+
+        RecordView FindView(const in_addr &addr, const string &language) const;
+
+        RecordView FindView(const in6_addr &addr, const string &language) const;
+
+        RecordView FindView(uint32_t addr, const string &language) const; // addr in host byte order
+
+        RecordView FindView(const sockaddr_storage &addr, const string &language) const;
+
+        // The Try* lookups report misses and errors as a Status instead of throwing, result is set on Status::Ok.
+        Status TryFind(const string &addr, const string &language, vector<string> &result) const;
+
+        Status TryFind(const in_addr &addr, const string &language, vector<string> &result) const;
+
+        Status TryFind(const in6_addr &addr, const string &language, vector<string> &result) const;
+
+        Status TryFind(uint32_t addr, const string &language, vector<string> &result) const;
 
-        vector<string> Find(const string &addr, const string &language);
+        Status TryFind(const sockaddr_storage &addr, const string &language, vector<string> &result) const;
 
-        map<string, string> FindMap(const string &addr, const string &language);
+        Status TryFindView(const string &addr, const string &language, RecordView &result) const;
+
+        Status TryFindView(const in_addr &addr, const string &language, RecordView &result) const;
+
+        Status TryFindView(const in6_addr &addr, const string &language, RecordView &result) const;
+
+        Status TryFindView(uint32_t addr, const string &language, RecordView &result) const;
+
+        Status TryFindView(const sockaddr_storage &addr, const string &language, RecordView &result) const;
+
+        // Row of the record addr resolves to in Table(language); needs language in ReaderOptions::tableLanguages.
+        Status TryFindRow(const string &addr, const string &language, uint32_t &row) const;
+
+        Status TryFindRow(const in_addr &addr, const string &language, uint32_t &row) const;
+
+        Status TryFindRow(const in6_addr &addr, const string &language, uint32_t &row) const;
+
+        Status TryFindRow(uint32_t addr, const string &language, uint32_t &row) const;
+
+        Status TryFindRow(const sockaddr_storage &addr, const string &language, uint32_t &row) const;
+
+        const RecordTable &Table(const string &language) const;
+
+        // Resolves language and field names once; an empty fields list selects every field.
+        PreparedQuery Prepare(const string &language, const vector<string> &fields = {}) const;
+
+        // Looks up count addresses at once, advancing the trie walks in lockstep so their cache misses overlap.
+        // out must hold count views; addresses that are not in the database get an empty view.
+        void FindBatch(const in_addr *addrs, size_t count, const string &language, RecordView *out) const;
+
+        void FindBatch(const in6_addr *addrs, size_t count, const string &language, RecordView *out) const;
+
+        // Mixed IPv4 and IPv6, e.g. from ParseAddresses; invalid and unsupported addresses get an empty view too.
+        void FindBatch(const Address *addrs, size_t count, const string &language, RecordView *out) const;
+
+        // FindBatch over threads workers (0: one per core), for inputs of millions of addresses. Workers steal
+        // chunks from each other, so uneven walks do not leave threads idle. out must hold count views.
+        void ParallelFind(const in_addr *addrs, size_t count, const string &language, RecordView *out,
+                          int threads = 0) const;
+
+        void ParallelFind(const in6_addr *addrs, size_t count, const string &language, RecordView *out,
+                          int threads = 0) const;
+
+        void ParallelFind(const Address *addrs, size_t count, const string &language, RecordView *out,
+                          int threads = 0) const;
+
+        // Every network of family (IPv4 or IPv6) that holds a record. IPv6 skips ::ffff:0:0/96,
+        // which is the IPv4 trie and is enumerated with IPv4.
+        LeafIterator Leaves(int family, const string &language) const;
+
+        // The same walk split into independent iterators, one per subtree at depth splitBits (at most 2^splitBits),
+        // so a dump can run in parallel.
+        vector<LeafIterator> SplitLeaves(int family, const string &language, int splitBits) const;
+
+        // Networks by value of field in language, e.g. Index("EN", "country_code")->Get("FR"). Built on first use
+        // from every leaf, in parallel over ReaderOptions::indexThreads, then kept within ReaderOptions::indexBytes.
+        shared_ptr<const FieldIndex> Index(const string &language, const string &field) const;
+
+        map<string, string> FindMap(const string &addr, const string &language) const;
+
+        map<string, string> FindMap(const in_addr &addr, const string &language) const;
+
+        map<string, string> FindMap(const in6_addr &addr, const string &language) const;
+
+        map<string, string> FindMap(uint32_t addr, const string &language) const; // addr in host byte order
+
+        map<string, string> FindMap(const sockaddr_storage &addr, const string &language) const;
 
         bool IsIPv4Support() const;
 
@@ -66,11 +574,61 @@ namespace ipdb {
 
         uint64_t BuildTime() const;
 
-        vector<string> Languages();
+        size_t V4TableBytes() const; // memory held by the IPv4 direct-index table
+
+        size_t TrieBytes() const; // memory held by the TrieEngine::Poptrie tables
+
+        CacheStats RecordCacheStats() const;
+
+        CacheStats RangeCacheStats() const; // of the calling thread
+
+        TableStats RecordTableStats() const;
+
+        CacheStats IndexStats() const; // Size and Capacity in bytes
+
+        MemoryStats ImageStats() const;
+
+        LookupMetrics Metrics() const; // summed over all threads
+
+        vector<string> Languages() const;
 
         vector<string> Fields() const;
     };
 
+    // A value decoded on first use and then shared by copies. Once ready, value never changes, so reading it takes
+    // no lock; only the first decode is serialized, per object.
+    template<typename T>
+    class Lazy {
+        mutable shared_ptr<T> value = nullptr;
+        mutable atomic<bool> ready{false};
+        mutable mutex decodeLock;
+    public:
+        Lazy() = default;
+
+        Lazy(const Lazy &other) {
+            *this = other;
+        }
+
+        Lazy &operator=(const Lazy &other) {
+            auto decoded = other.ready.load(memory_order_acquire);
+            value = decoded ? other.value : nullptr;
+            ready.store(decoded, memory_order_release);
+            return *this;
+        }
+
+        template<typename F>
+        shared_ptr<T> Get(F decode) const {
+            if (!ready.load(memory_order_acquire)) {
+                lock_guard<mutex> guard(decodeLock);
+                if (!ready.load(memory_order_relaxed)) {
+                    value = make_shared<T>(decode());
+                    ready.store(true, memory_order_release);
+                }
+            }
+            return value;
+        }
+    };
+
     class ASNInfo {
         string asn;
         string reg;
@@ -80,23 +638,27 @@ namespace ipdb {
         string type;
         string domain;
     public:
+        ASNInfo() = default;
+
         explicit ASNInfo(const vector<string> &data, const vector<string> &fields);
 
-        string GetAsn();
+        static string ASNInfo::*Field(string_view name);
+
+        string GetAsn() const;
 
-        string GetReg();
+        string GetReg() const;
 
-        string GetCc();
+        string GetCc() const;
 
-        string GetNet();
+        string GetNet() const;
 
-        string GetOrg();
+        string GetOrg() const;
 
-        string GetType();
+        string GetType() const;
 
-        string GetDomain();
+        string GetDomain() const;
 
-        string str();
+        string str() const;
     };
 
     class DistrictInfo {
@@ -109,32 +671,74 @@ namespace ipdb {
         string latitude;
         string longitude;
     public:
+        DistrictInfo() = default;
+
         explicit DistrictInfo(const vector<string> &data, const vector<string> &fields);
 
-        string GetCountryName();
+        DistrictInfo(const RecordView &view, const Schema<DistrictInfo> &schema);
+
+        static string DistrictInfo::*Field(string_view name);
 
-        string GetRegionName();
+        string GetCountryName() const;
 
-        string GetCityName();
+        string GetRegionName() const;
 
-        string GetDistrictName();
+        string GetCityName() const;
 
-        string GetChinaAdminCode();
+        string GetDistrictName() const;
 
-        string GetCoveringRadius();
+        string GetChinaAdminCode() const;
 
-        string GetLatitude();
+        string GetCoveringRadius() const;
 
-        string GetLongitude();
+        string GetLatitude() const;
 
-        string str();
+        string GetLongitude() const;
+
+        string str() const;
     };
 
     class District : public Reader {
+        Schema<DistrictInfo> schema;
     public:
-        explicit District(const string &file);
+        explicit District(const string &file, const ReaderOptions &options = ReaderOptions());
+
+        explicit District(int fd, const ReaderOptions &options = ReaderOptions());
+
+        District(const void *buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        District(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        DistrictInfo FindInfo(const string &addr, const string &language) const;
+
+        DistrictInfo FindInfo(const in_addr &addr, const string &language) const;
+
+        DistrictInfo FindInfo(const in6_addr &addr, const string &language) const;
+
+        DistrictInfo FindInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        DistrictInfo FindInfo(const sockaddr_storage &addr, const string &language) const;
+
+        // Like FindInfo, but shares the decoded value with the record cache when ReaderOptions::cacheSize is set.
+        shared_ptr<const DistrictInfo> FindSharedInfo(const string &addr, const string &language) const;
 
-        DistrictInfo FindInfo(const string &addr, const string &language);
+        shared_ptr<const DistrictInfo> FindSharedInfo(const in_addr &addr, const string &language) const;
+
+        shared_ptr<const DistrictInfo> FindSharedInfo(const in6_addr &addr, const string &language) const;
+
+        shared_ptr<const DistrictInfo> FindSharedInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        shared_ptr<const DistrictInfo> FindSharedInfo(const sockaddr_storage &addr, const string &language) const;
+
+        Status TryFindInfo(const string &addr, const string &language, DistrictInfo &info) const;
+
+        Status TryFindInfo(const in_addr &addr, const string &language, DistrictInfo &info) const;
+
+        Status TryFindInfo(const in6_addr &addr, const string &language, DistrictInfo &info) const;
+
+        Status TryFindInfo(uint32_t addr, const string &language, DistrictInfo &info) const;
+
+        Status TryFindInfo(const sockaddr_storage &addr, const string &language, DistrictInfo &info) const;
     };
 
     class CityInfo {
@@ -160,79 +764,124 @@ namespace ipdb {
         string currency_name;
         string anycast;
         string line;
-        shared_ptr<DistrictInfo> district_info;
+        string district_info; // JSON, decoded by GetDistrictInfo
+        bool hasDistrictInfo = false; // the database has a district_info field
         string route;
         string asn;
-        vector<shared_ptr<ASNInfo>> asn_info;
+        string asn_info; // JSON, decoded by GetASNInfo
         string area_code;
         string usage_type;
+        Lazy<DistrictInfo> decodedDistrictInfo;
+        Lazy<vector<shared_ptr<ASNInfo>>> decodedASNInfo;
     public:
+        CityInfo() = default;
+
         explicit CityInfo(const vector<string> &data, const vector<string> &fields);
 
-        string GetCountryName();
+        CityInfo(const RecordView &view, const Schema<CityInfo> &schema);
+
+        static string CityInfo::*Field(string_view name);
 
-        string GetRegionName();
+        string GetCountryName() const;
 
-        string GetCityName();
+        string GetRegionName() const;
 
-        string GetDistrictName();
+        string GetCityName() const;
 
-        string GetOwnerDomain();
+        string GetDistrictName() const;
 
-        string GetIspDomain();
+        string GetOwnerDomain() const;
 
-        string GetLatitude();
+        string GetIspDomain() const;
 
-        string GetLongitude();
+        string GetLatitude() const;
 
-        string GetTimezone();
+        string GetLongitude() const;
 
-        string GetUtcOffset();
+        string GetTimezone() const;
 
-        string GetChinaAdminCode();
+        string GetUtcOffset() const;
 
-        string GetIddCode();
+        string GetChinaAdminCode() const;
 
-        string GetCountryCode();
+        string GetIddCode() const;
 
-        string GetContinentCode();
+        string GetCountryCode() const;
 
-        string GetIDC();
+        string GetContinentCode() const;
 
-        string GetBaseStation();
+        string GetIDC() const;
 
-        string GetCountryCode3();
+        string GetBaseStation() const;
 
-        string GetEuropeanUnion();
+        string GetCountryCode3() const;
 
-        string GetCurrencyCode();
+        string GetEuropeanUnion() const;
 
-        string GetCurrencyName();
+        string GetCurrencyCode() const;
 
-        string GetAnycast();
+        string GetCurrencyName() const;
 
-        string GetLine();
+        string GetAnycast() const;
 
-        shared_ptr<DistrictInfo> GetDistrictInfo();
+        string GetLine() const;
 
-        string GetRoute();
+        shared_ptr<DistrictInfo> GetDistrictInfo() const; // null if the database has no district_info field, parsed on the first call
 
-        string GetASN();
+        string GetRoute() const;
 
-        vector<shared_ptr<ASNInfo>> GetASNInfo();
+        string GetASN() const;
 
-        string GetAreaCode();
+        vector<shared_ptr<ASNInfo>> GetASNInfo() const; // parses the asn_info JSON on the first call
 
-        string GetUsageType();
+        string GetAreaCode() const;
 
-        string str();
+        string GetUsageType() const;
+
+        string str() const;
     };
 
     class City : public Reader {
+        Schema<CityInfo> schema;
     public:
-        explicit City(const string &file);
+        explicit City(const string &file, const ReaderOptions &options = ReaderOptions());
+
+        explicit City(int fd, const ReaderOptions &options = ReaderOptions());
+
+        City(const void *buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        City(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        CityInfo FindInfo(const string &addr, const string &language) const;
+
+        CityInfo FindInfo(const in_addr &addr, const string &language) const;
+
+        CityInfo FindInfo(const in6_addr &addr, const string &language) const;
+
+        CityInfo FindInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        CityInfo FindInfo(const sockaddr_storage &addr, const string &language) const;
+
+        // Like FindInfo, but shares the decoded value with the record cache when ReaderOptions::cacheSize is set.
+        shared_ptr<const CityInfo> FindSharedInfo(const string &addr, const string &language) const;
 
-        CityInfo FindInfo(const string &addr, const string &language);
+        shared_ptr<const CityInfo> FindSharedInfo(const in_addr &addr, const string &language) const;
+
+        shared_ptr<const CityInfo> FindSharedInfo(const in6_addr &addr, const string &language) const;
+
+        shared_ptr<const CityInfo> FindSharedInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        shared_ptr<const CityInfo> FindSharedInfo(const sockaddr_storage &addr, const string &language) const;
+
+        Status TryFindInfo(const string &addr, const string &language, CityInfo &info) const;
+
+        Status TryFindInfo(const in_addr &addr, const string &language, CityInfo &info) const;
+
+        Status TryFindInfo(const in6_addr &addr, const string &language, CityInfo &info) const;
+
+        Status TryFindInfo(uint32_t addr, const string &language, CityInfo &info) const;
+
+        Status TryFindInfo(const sockaddr_storage &addr, const string &language, CityInfo &info) const;
     };
 
     class BaseStationInfo {
@@ -243,28 +892,70 @@ namespace ipdb {
         string isp_domain;
         string base_station;
     public:
+        BaseStationInfo() = default;
+
         explicit BaseStationInfo(const vector<string> &data, const vector<string> &fields);
 
-        string GetCountryName();
+        BaseStationInfo(const RecordView &view, const Schema<BaseStationInfo> &schema);
 
-        string GetRegionName();
+        static string BaseStationInfo::*Field(string_view name);
 
-        string GetCityName();
+        string GetCountryName() const;
 
-        string GetOwnerDomain();
+        string GetRegionName() const;
 
-        string GetIspDomain();
+        string GetCityName() const;
 
-        string GetBaseStation();
+        string GetOwnerDomain() const;
 
-        string str();
+        string GetIspDomain() const;
+
+        string GetBaseStation() const;
+
+        string str() const;
     };
 
     class BaseStation : public Reader {
+        Schema<BaseStationInfo> schema;
     public:
-        explicit BaseStation(const string &file);
+        explicit BaseStation(const string &file, const ReaderOptions &options = ReaderOptions());
+
+        explicit BaseStation(int fd, const ReaderOptions &options = ReaderOptions());
+
+        BaseStation(const void *buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        BaseStation(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        BaseStationInfo FindInfo(const string &addr, const string &language) const;
+
+        BaseStationInfo FindInfo(const in_addr &addr, const string &language) const;
+
+        BaseStationInfo FindInfo(const in6_addr &addr, const string &language) const;
+
+        BaseStationInfo FindInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        BaseStationInfo FindInfo(const sockaddr_storage &addr, const string &language) const;
 
-        BaseStationInfo FindInfo(const string &addr, const string &language);
+        // Like FindInfo, but shares the decoded value with the record cache when ReaderOptions::cacheSize is set.
+        shared_ptr<const BaseStationInfo> FindSharedInfo(const string &addr, const string &language) const;
+
+        shared_ptr<const BaseStationInfo> FindSharedInfo(const in_addr &addr, const string &language) const;
+
+        shared_ptr<const BaseStationInfo> FindSharedInfo(const in6_addr &addr, const string &language) const;
+
+        shared_ptr<const BaseStationInfo> FindSharedInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        shared_ptr<const BaseStationInfo> FindSharedInfo(const sockaddr_storage &addr, const string &language) const;
+
+        Status TryFindInfo(const string &addr, const string &language, BaseStationInfo &info) const;
+
+        Status TryFindInfo(const in_addr &addr, const string &language, BaseStationInfo &info) const;
+
+        Status TryFindInfo(const in6_addr &addr, const string &language, BaseStationInfo &info) const;
+
+        Status TryFindInfo(uint32_t addr, const string &language, BaseStationInfo &info) const;
+
+        Status TryFindInfo(const sockaddr_storage &addr, const string &language, BaseStationInfo &info) const;
     };
 
     class IDCInfo {
@@ -275,28 +966,249 @@ namespace ipdb {
         string isp_domain;
         string idc;
     public:
+        IDCInfo() = default;
+
         explicit IDCInfo(const vector<string> &data, const vector<string> &fields);
 
-        string GetCountryName();
+        IDCInfo(const RecordView &view, const Schema<IDCInfo> &schema);
 
-        string GetRegionName();
+        static string IDCInfo::*Field(string_view name);
 
-        string GetCityName();
+        string GetCountryName() const;
 
-        string GetOwnerDomain();
+        string GetRegionName() const;
 
-        string GetIspDomain();
+        string GetCityName() const;
 
-        string GetIDC();
+        string GetOwnerDomain() const;
 
-        string str();
+        string GetIspDomain() const;
+
+        string GetIDC() const;
+
+        string str() const;
     };
 
     class IDC : public Reader {
+        Schema<IDCInfo> schema;
+    public:
+        explicit IDC(const string &file, const ReaderOptions &options = ReaderOptions());
+
+        explicit IDC(int fd, const ReaderOptions &options = ReaderOptions());
+
+        IDC(const void *buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        IDC(shared_ptr<const void> buffer, size_t size, const ReaderOptions &options = ReaderOptions());
+
+        IDCInfo FindInfo(const string &addr, const string &language) const;
+
+        IDCInfo FindInfo(const in_addr &addr, const string &language) const;
+
+        IDCInfo FindInfo(const in6_addr &addr, const string &language) const;
+
+        IDCInfo FindInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        IDCInfo FindInfo(const sockaddr_storage &addr, const string &language) const;
+
+        // Like FindInfo, but shares the decoded value with the record cache when ReaderOptions::cacheSize is set.
+        shared_ptr<const IDCInfo> FindSharedInfo(const string &addr, const string &language) const;
+
+        shared_ptr<const IDCInfo> FindSharedInfo(const in_addr &addr, const string &language) const;
+
+        shared_ptr<const IDCInfo> FindSharedInfo(const in6_addr &addr, const string &language) const;
+
+        shared_ptr<const IDCInfo> FindSharedInfo(uint32_t addr, const string &language) const; // addr in host byte order
+
+        shared_ptr<const IDCInfo> FindSharedInfo(const sockaddr_storage &addr, const string &language) const;
+
+        Status TryFindInfo(const string &addr, const string &language, IDCInfo &info) const;
+
+        Status TryFindInfo(const in_addr &addr, const string &language, IDCInfo &info) const;
+
+        Status TryFindInfo(const in6_addr &addr, const string &language, IDCInfo &info) const;
+
+        Status TryFindInfo(uint32_t addr, const string &language, IDCInfo &info) const;
+
+        Status TryFindInfo(const sockaddr_storage &addr, const string &language, IDCInfo &info) const;
+    };
+
+    // One address looked up in every database of a MultiReader.
+    struct MultiResult {
+        vector<Status> Statuses; // per reader, in the MultiReader's order
+        vector<RecordView> Views; // Views[i] holds the record where Statuses[i] is Status::Ok
+    };
+
+    // Several databases queried together, e.g. City, IDC and BaseStation: the address is parsed once and the trie
+    // walks advance in lockstep, prefetching each next node, so their cache misses overlap.
+    class MultiReader {
+        vector<shared_ptr<const Reader>> readers;
+
+        Status find(int family, const u_char *ip, const string &language, MultiResult &result) const;
+
     public:
-        explicit IDC(const string &file);
+        explicit MultiReader(vector<shared_ptr<const Reader>> readers);
+
+        size_t Size() const;
+
+        const Reader &Get(size_t index) const;
 
-        IDCInfo FindInfo(const string &addr, const string &language);
+        MultiResult Find(const string &addr, const string &language) const; // throws ErrIPFormat
+
+        // Status::IPFormat if addr is not an address, Status::Ok otherwise with each reader's status in result.
+        Status TryFind(const string &addr, const string &language, MultiResult &result) const;
+
+        Status TryFind(const in_addr &addr, const string &language, MultiResult &result) const;
+
+        Status TryFind(const in6_addr &addr, const string &language, MultiResult &result) const;
+
+        Status TryFind(const Address &addr, const string &language, MultiResult &result) const;
+    };
+
+    enum class NodeLayout {
+        BreadthFirst, // top levels of the trie share the first pages, the default
+        DepthFirst,
+        VanEmdeBoas   // recursive blocks of levels, fewest cache lines per walk
     };
+
+    // Builds ipdb files from (network, record) pairs, e.g. to re-pack a vendor database or add internal ranges.
+    class Writer {
+        static constexpr int empty = -1;
+        vector<string> fields;
+        vector<string> languages;
+        uint64_t build = 0;
+        uint16_t ipVersion = 0;
+        NodeLayout layout = NodeLayout::BreadthFirst;
+        vector<int> children;       // two slots per node: empty, a node, or -(record + 2)
+        vector<u_char> depths;      // prefix length that set each leaf slot
+        vector<string> records;
+        vector<uint64_t> weights;
+        map<string, int> recordIndex;
+
+        int newNode(int value, u_char depth);
+
+        void assign(int slot, int record, int prefixLength);
+
+    public:
+        Writer(const vector<string> &fields, const vector<string> &languages);
+
+        explicit Writer(const Reader &reader); // every network and record of reader, to re-pack it
+
+        // values holds one row of fields per language, in the order given to the constructor. A more specific
+        // network wins over a less specific one whatever the insert order; the same network inserted twice keeps
+        // the last record. weight ranks the record's place in the data section, heaviest first.
+        void Insert(const Network &network, const vector<vector<string>> &values, uint64_t weight = 1);
+
+        void Insert(const string &cidr, const vector<vector<string>> &values, uint64_t weight = 1);
+
+        void SetBuild(uint64_t build);
+
+        void SetLayout(NodeLayout layout);
+
+        string Bytes() const;
+
+        void Save(const string &file) const;
+    };
+
+    // Serves lookups from a snapshot of R (Reader, City, IDC, ...) that Reload replaces atomically.
+    // A pinned snapshot stays valid after a reload; the old image is freed when its last holder drops it.
+    template<typename R>
+    class ReloadableReader {
+        shared_ptr<const R> current; // guarded by publishLock
+        atomic<uint64_t> generation{0}; // bumped with every publish
+        mutable mutex publishLock; // held only to swap or copy current, never while a file loads
+        shared_ptr<const void> pinKey = make_shared<char>(); // names this reader's pin in every thread
+        ReaderOptions options;
+        mutex reloadLock; // serializes reloads, never taken by lookups
+
+        void publish(shared_ptr<const R> next);
+    public:
+        explicit ReloadableReader(const string &file, const ReaderOptions &options = ReaderOptions());
+
+        // Each thread keeps its last snapshot and returns it while no reload has been published since, with no lock;
+        // the first call after a reload copies the new one under publishLock. A thread's pin of an old snapshot
+        // keeps its image until that thread's next Snapshot call.
+        shared_ptr<const R> Snapshot() const;
+
+        // Loads and validates file, then publishes it; throws and keeps the current snapshot on error.
+        void Reload(const string &file);
+
+        // The same from an image already in memory, e.g. a download; the snapshot shares ownership of buffer.
+        void Reload(shared_ptr<const void> buffer, size_t size);
+
+        // Runs Reload on a background thread; get() on the result rethrows its error.
+        // The ReloadableReader must outlive the returned future.
+        future<void> ReloadAsync(const string &file);
+
+        uint64_t BuildTime() const;
+    };
+
+    template<typename R>
+    ReloadableReader<R>::ReloadableReader(const string &file, const ReaderOptions &options)
+            : current(make_shared<const R>(file, options)), options(options) {}
+
+    template<typename R>
+    shared_ptr<const R> ReloadableReader<R>::Snapshot() const {
+        struct Pin {
+            weak_ptr<const void> key;
+            uint64_t generation = 0;
+            shared_ptr<const R> snapshot;
+        };
+        // one pin per thread per reader; the weak_ptr notices when the reader (and so its key) is freed and the
+        // key's address reused
+        static thread_local unordered_map<const void *, Pin> pins;
+        static thread_local const void *lastKey = nullptr;
+        static thread_local Pin *last = nullptr;
+        auto key = pinKey.get();
+        auto published = generation.load(memory_order_acquire);
+        if (lastKey == key && last->generation == published && !last->key.expired()) {
+            return last->snapshot;
+        }
+        auto &pin = pins[key];
+        if (!pin.snapshot || pin.generation != published || pin.key.expired()) {
+            for (auto it = pins.begin(); it != pins.end();) {
+                if (it->first != key && it->second.key.expired()) {
+                    it = pins.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            lock_guard<mutex> guard(publishLock);
+            pin.key = pinKey;
+            pin.snapshot = current;
+            pin.generation = generation.load(memory_order_relaxed);
+        }
+        lastKey = key;
+        last = &pin;
+        return pin.snapshot;
+    }
+
+    template<typename R>
+    void ReloadableReader<R>::publish(shared_ptr<const R> next) {
+        lock_guard<mutex> guard(publishLock);
+        current.swap(next); // next, released after the lock, drops the old snapshot unless a thread pins it
+        generation.fetch_add(1, memory_order_release);
+    }
+
+    template<typename R>
+    void ReloadableReader<R>::Reload(const string &file) {
+        lock_guard<mutex> guard(reloadLock);
+        publish(make_shared<const R>(file, options));
+    }
+
+    template<typename R>
+    void ReloadableReader<R>::Reload(shared_ptr<const void> buffer, size_t size) {
+        lock_guard<mutex> guard(reloadLock);
+        publish(make_shared<const R>(move(buffer), size, options));
+    }
+
+    template<typename R>
+    future<void> ReloadableReader<R>::ReloadAsync(const string &file) {
+        return async(launch::async, [this, file] { Reload(file); });
+    }
+
+    template<typename R>
+    uint64_t ReloadableReader<R>::BuildTime() const {
+        return Snapshot()->BuildTime();
+    }
 }
 #endif //IPDB_IPDB_H
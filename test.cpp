@@ -0,0 +1,345 @@
+#include "ipdb.h"
+#include <arpa/inet.h>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <set>
+
+// Equivalence checks over databases generated with ipdb::Writer; exits non-zero if any check fails.
+
+struct Inserted {
+    ipdb::Network network;
+    std::string name;
+};
+
+static std::mt19937_64 rng(1);
+
+static ipdb::Network randomNetwork(int family) {
+    u_char ip[16]{};
+    for (auto &b : ip) {
+        b = u_char(rng());
+    }
+    if (family == IPv4) {
+        ip[0] = u_char(10 + rng() % 4); // few top bytes, so networks nest and overlap
+        return ipdb::Network(IPv4, ip, int(8 + rng() % 25));
+    }
+    ip[0] = 0x20, ip[1] = 0x01, ip[2] = 0x0d, ip[3] = u_char(0xb8 + rng() % 2);
+    return ipdb::Network(IPv6, ip, int(24 + rng() % 105));
+}
+
+// A random database of nested IPv4 and IPv6 networks, and the list it was built from in insert order.
+static std::string randomDatabase(std::vector<Inserted> &inserted, ipdb::NodeLayout layout) {
+    ipdb::Writer writer({"name", "family"}, {"CN", "EN"});
+    writer.SetLayout(layout);
+    for (auto i = 0; i < 400; ++i) {
+        auto family = i % 3 ? IPv4 : IPv6;
+        auto network = i % 50 == 49 ? inserted[rng() % inserted.size()].network : randomNetwork(family);
+        auto name = "n" + std::to_string(i);
+        writer.Insert(network, {{name, "v" + std::to_string(network.Family)}, {name, "-"}}, 1 + rng() % 100);
+        inserted.push_back({network, name});
+    }
+    return writer.Bytes();
+}
+
+// The name of the most specific inserted network holding addr, the last one inserted among equals; empty if none.
+template<typename T>
+static std::string expected(const std::vector<Inserted> &inserted, const T &addr) {
+    std::string name;
+    auto best = -1;
+    for (auto &i : inserted) {
+        if (i.network.Contains(addr) && i.network.PrefixLength >= best) {
+            best = i.network.PrefixLength;
+            name = i.name;
+        }
+    }
+    return name;
+}
+
+static in_addr randomV4() {
+    in_addr addr{};
+    // 10.0.0.0 to 13.255.255.255, the first bytes randomNetwork uses
+    addr.s_addr = htonl(uint32_t(10 + rng() % 4) << 24 | (uint32_t(rng()) & 0x00ffffff));
+    return addr;
+}
+
+static in6_addr randomV6() {
+    in6_addr addr{};
+    for (auto &b : addr.s6_addr) {
+        b = u_char(rng());
+    }
+    addr.s6_addr[0] = 0x20, addr.s6_addr[1] = 0x01, addr.s6_addr[2] = 0x0d, addr.s6_addr[3] = u_char(0xb8 + rng() % 2);
+    return addr;
+}
+
+template<typename T>
+static std::string found(const ipdb::Reader &reader, const T &addr, const std::string &language) {
+    ipdb::RecordView view;
+    if (reader.TryFindView(addr, language, view) != ipdb::Status::Ok) {
+        return "";
+    }
+    return std::string(view.Get("name"));
+}
+
+static std::shared_ptr<ipdb::Reader> load(const std::string &bytes, const ipdb::ReaderOptions &options = {}) {
+    auto buffer = std::make_shared<std::string>(bytes);
+    return std::make_shared<ipdb::Reader>(std::shared_ptr<const void>(buffer, buffer->data()), buffer->size(), options);
+}
+
+// Writer output answers like a brute force longest prefix match, in every layout and after re-packing.
+static bool testWriter() {
+    auto bad = 0;
+    for (auto layout : {ipdb::NodeLayout::BreadthFirst, ipdb::NodeLayout::DepthFirst, ipdb::NodeLayout::VanEmdeBoas}) {
+        std::vector<Inserted> inserted;
+        auto reader = load(randomDatabase(inserted, layout));
+        auto repacked = load(ipdb::Writer(*reader).Bytes());
+        for (auto i = 0; i < 20000; ++i) {
+            auto v4 = randomV4();
+            auto v6 = randomV6();
+            auto want4 = expected(inserted, v4), want6 = expected(inserted, v6);
+            bad += found(*reader, v4, "CN") != want4 || found(*repacked, v4, "EN") != want4;
+            bad += found(*reader, v6, "EN") != want6 || found(*repacked, v6, "CN") != want6;
+        }
+    }
+    return bad == 0;
+}
+
+template<typename T>
+static bool sameMatch(const ipdb::Reader &a, const ipdb::Reader &b, const T &addr) {
+    ipdb::RecordView x, y;
+    auto status = a.TryFindView(addr, "CN", x);
+    return status == b.TryFindView(addr, "CN", y) &&
+           (status != ipdb::Status::Ok || (x.GetNetwork().str() == y.GetNetwork().str() && x.ToVector() == y.ToVector()));
+}
+
+// TrieEngine::Poptrie finds the same network and record as the bit by bit walk, for hits and misses.
+static bool testPoptrie() {
+    std::vector<Inserted> inserted;
+    auto bytes = randomDatabase(inserted, ipdb::NodeLayout::BreadthFirst);
+    ipdb::ReaderOptions options;
+    options.engine = ipdb::TrieEngine::Poptrie;
+    auto binary = load(bytes), poptrie = load(bytes, options);
+    auto bad = 0;
+    for (auto i = 0; i < 200000; ++i) {
+        auto v4 = randomV4();
+        auto v6 = randomV6();
+        if (i % 2) {
+            v4.s_addr = uint32_t(rng()); // mostly outside the networks
+            memset(v6.s6_addr, 0, 8 + rng() % 8);
+        }
+        bad += !sameMatch(*binary, *poptrie, v4) + !sameMatch(*binary, *poptrie, v6);
+    }
+    return bad == 0;
+}
+
+// The union of the index sets of a few random values, and those values.
+static ipdb::RangeSet randomUnion(const ipdb::FieldIndex &index, std::set<std::string> &values) {
+    auto all = index.Values();
+    ipdb::RangeSet set;
+    for (auto i = 0; i < 40; ++i) {
+        auto &value = all[rng() % all.size()];
+        if (values.insert(value).second) {
+            set = set.Union(index.Get(value));
+        }
+    }
+    return set;
+}
+
+// Two random unions of index sets and what the algebra makes of them.
+struct Algebra {
+    std::set<std::string> inA, inB;
+    ipdb::RangeSet a, either, both, onlyA;
+    std::vector<ipdb::Network> bothNetworks;
+
+    explicit Algebra(const ipdb::FieldIndex &index) {
+        a = randomUnion(index, inA);
+        auto b = randomUnion(index, inB);
+        either = a.Union(b), both = a.Intersect(b), onlyA = a.Subtract(b);
+        bothNetworks = both.Networks();
+    }
+
+    // every block of Networks lies inside the set, checked at both of its ends
+    bool NetworksInside() const {
+        for (auto &network : bothNetworks) {
+            u_char last[16];
+            memcpy(last, network.Address, sizeof(last));
+            auto bits = network.Family == IPv4 ? 32 : 128;
+            for (auto bit = network.PrefixLength; bit < bits; ++bit) {
+                last[bit / 8] |= u_char(0x80 >> (bit % 8));
+            }
+            for (auto ip : {network.Address, (const u_char *) last}) {
+                in_addr v4{};
+                in6_addr v6{};
+                memcpy(&v4, ip, sizeof(v4));
+                memcpy(&v6, ip, sizeof(v6));
+                if (!(network.Family == IPv4 ? both.Contains(v4) : both.Contains(v6))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    template<typename T>
+    bool Check(const ipdb::Reader &reader, const T &addr) const {
+        auto name = found(reader, addr, "CN");
+        auto x = inA.count(name) > 0, y = inB.count(name) > 0;
+        auto covered = false;
+        for (auto &network : bothNetworks) {
+            covered |= network.Contains(addr);
+        }
+        return a.Contains(addr) == x && either.Contains(addr) == (x || y) && both.Contains(addr) == (x && y) &&
+               onlyA.Contains(addr) == (x && !y) && covered == (x && y);
+    }
+};
+
+// Reader::Index sets and their union, intersection and difference hold exactly the addresses whose lookup
+// gives one of the chosen values, and Networks covers the same addresses.
+static bool testRangeSet() {
+    std::vector<Inserted> inserted;
+    auto reader = load(randomDatabase(inserted, ipdb::NodeLayout::BreadthFirst));
+    auto index = reader->Index("CN", "name");
+    auto bad = 0;
+    for (auto round = 0; round < 20; ++round) {
+        Algebra algebra(*index);
+        bad += !algebra.NetworksInside();
+        for (auto i = 0; i < 2000; ++i) {
+            bad += !algebra.Check(*reader, randomV4()) + !algebra.Check(*reader, randomV6());
+        }
+    }
+    return bad == 0 && index->Get("none").Empty();
+}
+
+// An IPv4 image of nodeCount nodes whose data section holds words, big endian.
+static std::string craftedImage(int nodeCount, const std::vector<uint32_t> &words) {
+    auto meta = "{\"build\":1,\"ip_version\":1,\"languages\":{\"CN\":0},\"node_count\":" + std::to_string(nodeCount) +
+                ",\"total_size\":" + std::to_string(words.size() * 4) + ",\"fields\":[\"name\"]}";
+    std::string image(4, '\0');
+    auto length = htonl(uint32_t(meta.size()));
+    memcpy(&image[0], &length, 4);
+    image += meta;
+    for (auto word : words) {
+        word = htonl(word);
+        image.append((const char *) &word, 4);
+    }
+    return image;
+}
+
+// Loads image from an exactly sized heap buffer and looks up 1.2.3.4, so a read past the image is caught by ASan.
+static ipdb::Status findInBorrowed(const std::string &image) {
+    std::unique_ptr<char[]> buffer(new char[image.size()]);
+    memcpy(buffer.get(), image.data(), image.size());
+    try {
+        ipdb::Reader reader(buffer.get(), image.size());
+        ipdb::RecordView view;
+        return reader.TryFindView("1.2.3.4", "CN", view);
+    } catch (const char *e) {
+        return strcmp(e, ErrDatabaseError) ? ipdb::Status::Ok : ipdb::Status::DatabaseError;
+    }
+}
+
+// Corrupt images are rejected without reading past a borrowed buffer.
+static bool testCorrupt() {
+    // node_count fills the data section: no room for the empty marker node a walk reads
+    auto noMarker = findInBorrowed(craftedImage(1, {1, 1}));
+    // a record pointer to the last byte, whose length field runs past the end
+    auto lastByte = findInBorrowed(craftedImage(1, {8, 8, 0, 0}));
+    return noMarker == ipdb::Status::DatabaseError && lastByte == ipdb::Status::DatabaseError;
+}
+
+// A random mix of addresses, near-addresses and noise, none holding a newline.
+static std::string randomToken() {
+    static const char *seeds[] = {"1.2.3.4", "255.255.255.255", "01.2.3.4", "1.2.3", "256.1.1.1", "1.2.3.4.", "::", "::1", "1::",
+                                  ":::", "1:2:3:4:5:6:7:8", "1:2:3:4:5:6:7::8", "::ffff:1.2.3.4", "fe80::1%1", "1:2:3:4:5:6:1.2.3.4",
+                                  "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255", "12345::", "::1.2.3.4:1"};
+    static const std::string alphabet = "0123456789abcdefABCDEF:.:.::x ";
+    char text[64];
+    std::string token;
+    switch (rng() % 4) {
+        case 0:
+            token = seeds[rng() % (sizeof(seeds) / sizeof(*seeds))];
+            break;
+        case 1:
+            snprintf(text, sizeof(text), "%u.%u.%u.%u", unsigned(rng() % 300), unsigned(rng() % 256), unsigned(rng() % 256),
+                     unsigned(rng() % 256));
+            token = text;
+            break;
+        case 2: {
+            u_char ip[16];
+            for (auto &b : ip) {
+                b = rng() % 4 ? u_char(rng()) : 0;
+            }
+            token = inet_ntop(AF_INET6, ip, text, sizeof(text));
+            break;
+        }
+        default:
+            for (auto n = rng() % 48; n > 0; --n) {
+                token += alphabet[rng() % alphabet.size()];
+            }
+    }
+    for (auto edits = rng() % 3; edits > 0 && !token.empty(); --edits) {
+        auto pos = rng() % token.size();
+        if (rng() % 2) {
+            token[pos] = alphabet[rng() % alphabet.size()];
+        } else {
+            token.erase(pos, 1);
+        }
+    }
+    return token;
+}
+
+static bool sameAsPton(const std::string &token, const ipdb::Address &address) {
+    u_char ip[16]{};
+    auto family = inet_pton(AF_INET, token.c_str(), ip) == 1 ? IPv4 : inet_pton(AF_INET6, token.c_str(), ip) == 1 ? IPv6 : 0;
+    return address.Family == family && (family == 0 || memcmp(ip, address.Bytes, family == IPv4 ? 4 : 16) == 0);
+}
+
+// ParseAddress and ParseAddresses accept and decode exactly what inet_pton does.
+// Parses text joined by newlines out of an exactly sized heap buffer, so a read past the last token is caught by
+// ASan; a std::string would hide one byte of it behind its NUL.
+static bool parsesAsPton(const std::vector<std::string> &tokens) {
+    std::string joined;
+    for (auto &token : tokens) {
+        joined += token + "\n";
+    }
+    joined.pop_back(); // no empty token after the last delimiter
+    std::unique_ptr<char[]> buffer(new char[joined.size()]);
+    memcpy(buffer.get(), joined.data(), joined.size());
+    std::vector<ipdb::Address> addresses;
+    auto count = ipdb::ParseAddresses(std::string_view(buffer.get(), joined.size()), '\n', addresses);
+    auto bad = count != tokens.size() || addresses.size() != tokens.size();
+    for (size_t i = 0; !bad && i < tokens.size(); ++i) {
+        std::unique_ptr<char[]> token(new char[tokens[i].size()]);
+        memcpy(token.get(), tokens[i].data(), tokens[i].size());
+        ipdb::Address address;
+        ipdb::ParseAddress(std::string_view(token.get(), tokens[i].size()), address);
+        bad = !sameAsPton(tokens[i], address) || !sameAsPton(tokens[i], addresses[i]);
+    }
+    return !bad;
+}
+
+static bool testParse() {
+    std::vector<std::string> tokens;
+    for (auto i = 0; i < 200000; ++i) {
+        tokens.push_back(randomToken());
+    }
+    auto ok = parsesAsPton(tokens);
+    // tokens that end the buffer, empty last octets included
+    for (auto last : {"11.22.33.", "1.2.3.", "1.2.3.4", "1.2.3.45", "::1.2.3.", "1::"}) {
+        ok &= parsesAsPton({"10.0.0.1", last}) && parsesAsPton({last});
+    }
+    return ok;
+}
+
+int main() {
+    auto failed = 0;
+    for (auto &test : {std::make_pair("writer", testWriter), std::make_pair("parse", testParse),
+                         std::make_pair("poptrie", testPoptrie),
+                         std::make_pair("rangeset", testRangeSet),
+                         std::make_pair("corrupt", testCorrupt)}) {
+        auto ok = test.second();
+        std::cout << test.first << ": " << (ok ? "ok" : "FAILED") << std::endl;
+        failed += !ok;
+    }
+    return failed != 0;
+}